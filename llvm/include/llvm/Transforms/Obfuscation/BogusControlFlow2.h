@@ -1,6 +1,8 @@
 #pragma once
 
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 
 using namespace llvm;
@@ -12,6 +14,31 @@ struct BogusControlFlow2 {
   static bool isRequired() { return true; }
 };
 
+// 虚假控制流使用的不透明谓词，全局变量每个模块只创建一次，
+// 每个函数在入口处只加载一次
+class OpaquePredicates {
+public:
+  OpaquePredicates(Function &F, GlobalVariable *X, GlobalVariable *Y,
+                   CryptoUtils &RandomEngine);
+
+  static GlobalVariable *createGlobal(Module &M, StringRef Name);
+
+  // 在insertAfter末尾创建一个恒为真的条件，hot为真时只使用代价最低的形式
+  Value *create(BasicBlock *insertAfter, bool hot);
+
+private:
+  Function &F;
+  GlobalVariable *XPtr;
+  GlobalVariable *YPtr;
+  CryptoUtils &RandomEngine;
+  Value *EntryX = nullptr;
+  Value *HoistedCond = nullptr;
+  SmallVector<Argument *, 4> IntArgs;
+
+  Value *loadEntryX();
+  Value *createEvenProduct(IRBuilder<> &builder, Value *V);
+};
+
 }; // namespace polaris
 
 
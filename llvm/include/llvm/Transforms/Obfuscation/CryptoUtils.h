@@ -17,17 +17,12 @@
 #ifndef LLVM_CryptoUtils_H
 #define LLVM_CryptoUtils_H
 
-#include "llvm/Support/ManagedStatic.h"
-
 #include <stdint.h>
 #include <cstdio>
 #include <string>
 
 namespace llvm {
 
-class CryptoUtils;
-extern ManagedStatic<CryptoUtils> cryptoutils;
-
 #define BYTE(x, n) (((x) >> (8 * (n))) & 0xFF)
 
 #if defined(__i386) || defined(__i386__) || defined(_M_IX86) ||                \
@@ -174,8 +169,6 @@ extern ManagedStatic<CryptoUtils> cryptoutils;
 #define AES_TE4_2(x) AES_PRECOMP_TE4_2[(x)]
 #define AES_TE4_3(x) AES_PRECOMP_TE4_3[(x)]
 
-#define CryptoUtils_POOL_SIZE (0x1 << 17) // 2^17
-
 #define DUMP(x, l, s)                                                          \
   fprintf(stderr, "%s :", (s));                                                \
   for (int ii = 0; ii < (l); ii++) {                                           \
@@ -206,6 +199,8 @@ extern ManagedStatic<CryptoUtils> cryptoutils;
     ((unsigned long)(x) << (unsigned long)(32 - ((y) & 31)))) &                \
    0xFFFFFFFFUL)
 
+// There is no shared instance: every pass owns its generator, so concurrent
+// pipelines (e.g. in-process ThinLTO backends) never touch the same state.
 class CryptoUtils {
 public:
   CryptoUtils();
@@ -235,7 +230,8 @@ private:
   uint32_t ks[44];
   char key[16];
   char ctr[16];
-  char pool[CryptoUtils_POOL_SIZE];
+  // 当前计数器块的密钥流, 按需生成, 不再预填充大缓冲区
+  char block[16];
   uint32_t idx;
   std::string seed;
   bool seeded;
@@ -250,7 +246,7 @@ private:
   void aes_encrypt(char *out, const char *in, const uint32_t *ks);
   void prng_seed();
   void inc_ctr();
-  void populate_pool();
+  void refill_block();
   int sha256_done(sha256_state *md, unsigned char *out);
   int sha256_init(sha256_state *md);
   static int sha256_compress(sha256_state *md, unsigned char *buf);
@@ -0,0 +1,51 @@
+#ifndef OBFUSCATION_HOTNESS_H
+#define OBFUSCATION_HOTNESS_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Function.h"
+#include <algorithm>
+
+namespace llvm {
+
+// 混淆时的冷热分级：Hot 只使用代价最低的形式，Skip 完全不做混淆
+enum class ObfHotness { Normal, Hot, Skip };
+
+// 在函数被修改之前计算一次各基本块的冷热，之后新建的基本块都视为 Normal
+// 由 -irobf-hotness 选择依据：默认把循环内的基本块视为 Hot，
+// profile 模式使用 -fprofile-use / AutoFDO 附带的 ProfileSummaryInfo 和 BlockFrequencyInfo，
+// static 模式在没有 profile 时根据循环深度、分支概率和 hot/cold/minsize 属性估计
+class HotnessInfo {
+public:
+  // SkipOnly 为真时只关心 Skip，当前模式不会产生 Skip 就不计算任何分析
+  explicit HotnessInfo(Function &F, bool SkipOnly = false);
+
+  ObfHotness function() const {
+    return FunctionHotness;
+  }
+
+  ObfHotness block(const BasicBlock *BB) const {
+    // 函数的分级是块的下限，Skip 最强
+    return std::max(FunctionHotness, Blocks.lookup(BB));
+  }
+
+  bool isHot(const BasicBlock *BB) const {
+    return block(BB) != ObfHotness::Normal;
+  }
+
+  bool skip(const BasicBlock *BB) const {
+    return block(BB) == ObfHotness::Skip;
+  }
+
+  bool skipFunction() const {
+    return FunctionHotness == ObfHotness::Skip;
+  }
+
+private:
+  ObfHotness                               FunctionHotness = ObfHotness::Normal;
+  // 只记录非 Normal 的基本块
+  DenseMap<const BasicBlock *, ObfHotness> Blocks;
+};
+
+}
+
+#endif
@@ -3,8 +3,10 @@
 
 namespace llvm {
 class FunctionPass;
-FunctionPass *createLegacyLowerSwitchPass();
+class SwitchInst;
+FunctionPass *createLegacyLowerSwitchPass(bool KeepJumpTables = false);
+// 判断switch是否足够密集，后端会为其生成跳转表
+bool isJumpTableSwitch(const SwitchInst *SI);
 }
 
 #endif
-
@@ -0,0 +1,60 @@
+#ifndef OBFUSCATION_OBFUSCATIONBUDGET_H
+#define OBFUSCATION_OBFUSCATIONBUDGET_H
+
+#include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
+
+namespace llvm {
+
+class TargetTransformInfo;
+
+// 每个函数允许的混淆代价，0 表示不限制
+struct ObfuscationBudget {
+  // 混淆后的指令数最多是原来的百分之几，200 即不超过 2 倍
+  uint32_t SizePercent = 0;
+  // 按基本块频率加权估计的执行周期最多增加百分之几
+  uint32_t CyclePercent = 0;
+
+  bool enabled() const {
+    return SizePercent != 0 || CyclePercent != 0;
+  }
+};
+
+// 各个混淆在给定等级下增加的指令数和周期的估计，单位代价取自目标的 TTI
+class ObfuscationCostModel {
+public:
+  struct Cost {
+    double Size = 0;
+    double Cycles = 0;
+  };
+
+  ObfuscationCostModel(Function &F, const TargetTransformInfo &TTI);
+
+  const Cost &base() const {
+    return Base;
+  }
+
+  Cost overhead(unsigned Slot, uint32_t Level) const;
+
+private:
+  // 每种混淆处理的位置数，Count 是静态个数，Freq 按块频率加权
+  struct Sites {
+    double Count = 0;
+    double Freq = 0;
+  };
+
+  Cost  Base;
+  Sites SlotSites[ObfuscationOptions::NumOpts];
+  // TTI 给出的单条指令代价
+  double Alu = 1, Load = 1, Branch = 1, IndirectBranch = 1, Call = 1;
+};
+
+// 逐步降低等级或关闭代价最大的混淆，直到估计的代价在预算内，返回是否有改动
+// 打开 -Rpass=ir-obfuscation 时输出选择的结果
+bool fitObfuscationBudget(Function &F, const TargetTransformInfo &TTI,
+                          const ObfuscationBudget &Budget,
+                          ArrayRef<std::shared_ptr<ObfOpt>> AllOpt,
+                          ObfuscationOptions::FunctionOpts &Opts);
+
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef OBFUSCATION_OBFUSCATIONDATA_H
+#define OBFUSCATION_OBFUSCATIONDATA_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+
+namespace llvm {
+
+// 登记混淆生成的全局变量（密钥、地址表、加密常量）及其所属函数
+// 登记过的全局变量由 finalizeObfuscationData 统一加入 llvm.compiler.used，各个Pass不要再单独添加
+void registerObfuscationData(GlobalVariable *GV, Function *Owner);
+Function *getObfuscationDataOwner(const GlobalVariable *GV);
+
+// 把登记过的全局变量按函数顺序合并到按缓存行对齐的只读/可写数据块里，相同的只读数据只保留一份
+bool packObfuscationData(Module &M);
+// 把登记过的全局变量与所属函数关联（同一个comdat或!associated），链接器回收函数时一并回收
+bool associateObfuscationData(Module &M);
+// 一次性把登记过的全局变量加入 llvm.compiler.used 并清除登记信息
+void finalizeObfuscationData(Module &M);
+
+}
+
+#endif
@@ -5,13 +5,21 @@
 #include "llvm/IR/Function.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Regex.h"
 
+#include <functional>
 
 namespace llvm {
 
 SmallVector<std::string> readAnnotate(Function *f);
 
 class ObfuscationOptions;
+class TargetTransformInfo;
+
+// 由新 PassManager 提供的 TTI 查询，旧 PassManager 下为空
+using TTIGetterTy = std::function<const TargetTransformInfo *(Function &)>;
 
 class ObfOpt {
 protected:
@@ -19,13 +27,16 @@ protected:
   uint32_t    Enabled;
   uint32_t    Level;
   std::string AttributeName;
+  unsigned    Slot;
 
 public:
-  ObfOpt(ObfuscationOptions* owner, const std::string &attributeName) {
+  ObfOpt(ObfuscationOptions* owner, const std::string &attributeName,
+         unsigned slot = 0) {
     this->Owner = owner;
     this->Enabled = false;
     this->Level = 0;
     this->AttributeName = attributeName;
+    this->Slot = slot;
   }
 
   void readOpt(const cl::opt<bool> &enableOpt) {
@@ -66,13 +77,87 @@ public:
     return this->AttributeName;
   }
 
+  // 在 ObfuscationOptions::getAllOpt() 中的位置
+  unsigned slot() const {
+    return this->Slot;
+  }
+
   ObfOpt none() const {
-    return ObfOpt(owner(), this->attributeName());
+    return ObfOpt(owner(), this->attributeName(), this->slot());
+  }
+
+};
+
+// -ollvm-config 规则组编译后的匹配器，加载时编译一次
+// 字面量规则按 ^...$ / ^... / ...$ / 子串直接比较，完整匹配的名字走哈希表，其余才用正则
+class FunctionRuleMatcher {
+public:
+  // 每个规则组中第一条命中的模块规则，同一模块只需计算一次
+  struct ModuleMatch {
+    unsigned Index = ~0u;
+    bool     Skip = false;
+  };
+
+  void addGroup(ArrayRef<std::string> rules, const std::string &annotation);
+
+  bool empty() const {
+    return Groups.empty();
   }
 
+  SmallVector<ModuleMatch> matchModule(StringRef moduleName) const;
+
+  // 按规则组顺序追加 functionName 命中的注解
+  void appendMatches(SmallVector<std::string> &list, StringRef functionName,
+                     ArrayRef<ModuleMatch> moduleMatches) const;
+
+private:
+  enum class Kind { Any, Never, Exact, Prefix, Suffix, Contains, Regex };
+
+  struct Rule {
+    unsigned                   Index;
+    bool                       Skip;
+    Kind                       K;
+    std::string                Text;
+    std::shared_ptr<llvm::Regex> RE;
+  };
+
+  struct Group {
+    std::string       Annotation;
+    std::vector<Rule> ModuleRules;
+    // 不含完整名字匹配，那些放在 ExactNames 里
+    std::vector<Rule> FunctionRules;
+  };
+
+  static Rule compile(unsigned index, bool skip, StringRef pattern);
+  static bool matches(const Rule &rule, StringRef name);
+
+  std::vector<Group> Groups;
+  // 完整名字 -> (规则组, 规则序号, 是否排除)
+  StringMap<SmallVector<std::tuple<unsigned, unsigned, bool>, 1>> ExactNames;
 };
 
 class ObfuscationOptions {
+public:
+  // getAllOpt 中的顺序，也是 FunctionOpts 的下标
+  enum OptSlot : unsigned {
+    IndBrSlot,
+    ICallSlot,
+    IndGvSlot,
+    FlaSlot,
+    SubSlot,
+    BcfSlot,
+    CseSlot,
+    CieSlot,
+    CfeSlot,
+    NumOpts
+  };
+
+  // 一个函数对全部混淆选项的解析结果
+  struct FunctionOpts {
+    bool     Enabled[NumOpts];
+    uint32_t Level[NumOpts];
+  };
+
 protected:
   std::shared_ptr<ObfOpt> IndBrOpt = nullptr;
   std::shared_ptr<ObfOpt> ICallOpt = nullptr;
@@ -84,7 +169,19 @@ protected:
   std::shared_ptr<ObfOpt> CieOpt = nullptr;
   std::shared_ptr<ObfOpt> CfeOpt = nullptr;
 
-  std::vector<std::pair<std::vector<std::string>, std::string>> FunctionConfig;
+  FunctionRuleMatcher FunctionConfig;
+
+  // 每个模块扫描一次注解和配置规则得到的索引，没有命中时 toObfuscate 现场解析
+  DenseMap<const Function *, FunctionOpts> FunctionIndex;
+  bool        Indexed = false;
+  bool        EnabledAnywhere[NumOpts] = {};
+
+  TTIGetterTy TTIGetter;
+  uint32_t    BudgetSizePercent = 0;
+  uint32_t    BudgetCyclePercent = 0;
+  bool        RelativeTable = false;
+  bool        HoistKeys = false;
+  std::string Seed;
 
 public:
   SmallVector<std::shared_ptr<ObfOpt>> getAllOpt() const {
@@ -102,15 +199,15 @@ public:
   }
 
   ObfuscationOptions() {
-    this->IndBrOpt = std::make_shared<ObfOpt>(this, "indbr");
-    this->ICallOpt = std::make_shared<ObfOpt>(this, "icall");
-    this->IndGvOpt = std::make_shared<ObfOpt>(this, "indgv");
-    this->FlaOpt = std::make_shared<ObfOpt>(this, "fla");
-    this->SubOpt = std::make_shared<ObfOpt>(this, "sub");
-    this->BcfOpt = std::make_shared<ObfOpt>(this, "bcf");
-    this->CseOpt = std::make_shared<ObfOpt>(this, "cse");
-    this->CieOpt = std::make_shared<ObfOpt>(this, "cie");
-    this->CfeOpt = std::make_shared<ObfOpt>(this, "cfe");
+    this->IndBrOpt = std::make_shared<ObfOpt>(this, "indbr", IndBrSlot);
+    this->ICallOpt = std::make_shared<ObfOpt>(this, "icall", ICallSlot);
+    this->IndGvOpt = std::make_shared<ObfOpt>(this, "indgv", IndGvSlot);
+    this->FlaOpt = std::make_shared<ObfOpt>(this, "fla", FlaSlot);
+    this->SubOpt = std::make_shared<ObfOpt>(this, "sub", SubSlot);
+    this->BcfOpt = std::make_shared<ObfOpt>(this, "bcf", BcfSlot);
+    this->CseOpt = std::make_shared<ObfOpt>(this, "cse", CseSlot);
+    this->CieOpt = std::make_shared<ObfOpt>(this, "cie", CieSlot);
+    this->CfeOpt = std::make_shared<ObfOpt>(this, "cfe", CfeSlot);
   }
 
   auto indBrOpt() const {
@@ -149,11 +246,77 @@ public:
     return CfeOpt;
   }
 
+  void setTTIGetter(TTIGetterTy getter) {
+    this->TTIGetter = std::move(getter);
+  }
+
+  const TargetTransformInfo *getTTI(Function &F) const {
+    return TTIGetter ? TTIGetter(F) : nullptr;
+  }
+
+  // 模块默认的代价预算，函数可以用 ^budget-size= / ^budget-cycles= 注解覆盖
+  void setBudget(uint32_t sizePercent, uint32_t cyclePercent) {
+    this->BudgetSizePercent = sizePercent;
+    this->BudgetCyclePercent = cyclePercent;
+  }
+
+  void setRelativeTable(bool relative) {
+    this->RelativeTable = relative;
+  }
+
+  bool relativeTable() const {
+    return RelativeTable;
+  }
+
+  void setHoistKeys(bool hoist) {
+    this->HoistKeys = hoist;
+  }
+
+  bool hoistKeys() const {
+    return HoistKeys;
+  }
+
+  void setSeed(const std::string &seed) {
+    this->Seed = seed;
+  }
+
+  const std::string &seed() const {
+    return Seed;
+  }
+
   static std::shared_ptr<ObfuscationOptions> readConfigFile(
       const Twine &FileName);
 
   static ObfOpt toObfuscate(const std::shared_ptr<ObfOpt> &option, Function *f);
 
+  // 一次遍历注解和配置规则，解析模块中每个函数的全部选项
+  void buildFunctionIndex(Module &M);
+
+  // 把索引中的解析结果写到函数的元数据上，随 -irobf-split-jobs 的分区一起带走
+  void attachFunctionOpts(Module &M) const;
+
+  // 函数被删除或替换前调用，保留 enabledAnywhere 的结果
+  void dropFunctionIndex() {
+    FunctionIndex.clear();
+  }
+
+  // 没有建立索引时保守地返回 true
+  bool enabledAnywhere(const std::shared_ptr<ObfOpt> &option) const {
+    return !Indexed || EnabledAnywhere[option->slot()];
+  }
+
+  bool enabledAnywhere() const {
+    if (!Indexed) {
+      return true;
+    }
+    for (bool E : EnabledAnywhere) {
+      if (E) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   void loadFunctionConfig(const Twine &configPathOpt);
 
 };
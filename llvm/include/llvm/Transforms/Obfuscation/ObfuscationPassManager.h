@@ -10,6 +10,7 @@
 #include "llvm/Transforms/Obfuscation/ConstantFPEncryption.h"
 #include "llvm/Transforms/Obfuscation/Substitution.h"
 #include "llvm/Transforms/Obfuscation/BogusControlFlow2.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Passes/PassBuilder.h"
 
 // Namespace
@@ -18,13 +19,16 @@ class ModulePass;
 class PassRegistry;
 
 ModulePass *createObfuscationPassManager();
+ModulePass *createObfuscationPassManager(TTIGetterTy GetTTI);
 void initializeObfuscationPassManagerPass(PassRegistry &Registry);
 
 class ObfuscationPassManagerPass
     : public PassInfoMixin<ObfuscationPassManagerPass> {
 public:
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-    ModulePass *OPM = createObfuscationPassManager();
+    auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    ModulePass *OPM = createObfuscationPassManager(
+        [&FAM](Function &F) { return &FAM.getResult<TargetIRAnalysis>(F); });
     bool Changed = OPM->runOnModule(M);
     OPM->doFinalization(M);
     delete OPM;
@@ -2,18 +2,82 @@
 #define __UTILS_OBF__
 
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/Local.h" // For DemoteRegToStack and DemotePHIToStack
 
 using namespace llvm;
 
+namespace llvm {
+class CryptoUtils;
+class ObfuscationOptions;
+} // namespace llvm
+
 bool valueEscapes(Instruction *Inst);
 void fixStack(Function *f);
 CallBase* fixEH(CallBase* CB);
 void LowerConstantExpr(Function &F);
 bool expandConstantExpr(Function &F);
+// 设置分支权重，超出32位的权重会按比例缩小
+void setScaledBranchWeights(Instruction *I, ArrayRef<uint64_t> Weights);
+// 标记混淆生成的分支中几乎不会执行的后继，让后端把它排到热路径之外
+void setUnlikelySuccessor(Instruction *Term, unsigned Succ);
+// 目标都是基本块地址或dso_local的全局符号时才能使用相对偏移表
+bool canUseRelativeTable(ArrayRef<Constant *> Targets);
+// 只有打开了 -Rpass 或 -fsave-optimization-record 时才需要统计混淆备注
+bool obfuscationRemarksEnabled(const Function &F);
+// 生成加密的目标地址表，Relative 时每项是相对表地址的32位偏移，放在只读段且没有动态重定位
+GlobalVariable *createTargetTable(Module &M, ArrayRef<Constant *> Targets,
+                                  ArrayRef<Constant *> Keys, bool Relative,
+                                  const Twine &Name);
+// 读取目标表的第 Idx 项并用 DecKey 解密，Relative 时 DecKey 是 i32 且只使用低30位
+Value *loadTargetAddress(IRBuilderBase &IRB, GlobalVariable *Table,
+                         Value *Idx, Value *DecKey, bool Relative,
+                         const Twine &Name = "");
+
+
+// 间接跳转/调用/全局变量共用的解密密钥计算
+// Hoist 时密钥在入口块读取并解密一次，常量下标的解密结果在整个函数内复用
+class IndirectKeyDecoder {
+public:
+  IndirectKeyDecoder(Function &F, IntegerType *IntTy, ConstantInt *EncKey,
+                     ConstantInt *EncKey1, GlobalVariable *GXorKey,
+                     GlobalVariable *XorKeys, unsigned Level, bool Hoist);
+
+  Value *get(IRBuilder<> &IRB, Value *Idx);
+
+  bool isHoisted() const { return Hoist; }
+  // 不提升时本应生成的密钥读取次数与实际生成的次数
+  unsigned loadsRequested() const { return LoadsRequested; }
+  unsigned loadsEmitted() const { return LoadsEmitted; }
+
+private:
+  Value *build(IRBuilder<> &IRB, Value *Idx, Value *XorKey);
+  Value *loadXorKey(IRBuilder<> &IRB);
+  IRBuilder<> getEntryBuilder();
+  void updateLastHoisted(IRBuilder<> &IRB);
+
+  Function &F;
+  IntegerType *IntTy;
+  ConstantInt *EncKey;
+  ConstantInt *EncKey1;
+  GlobalVariable *GXorKey;
+  GlobalVariable *XorKeys;
+  unsigned Level;
+  bool Hoist;
 
+  Value *HoistedXorKey = nullptr;
+  Instruction *LastHoisted = nullptr;
+  DenseMap<ConstantInt *, Value *> HoistedKeys;
+  unsigned LoadsRequested = 0;
+  unsigned LoadsEmitted = 0;
+};
 
+// 设置了 -irobf-seed 时，用 seed、模块名、Pass 名和函数名的哈希重新设置随机数种子，
+// 使每个函数每个 Pass 的随机序列固定且与编译顺序无关；F 为空时只用模块名
+void seedRandomEngine(CryptoUtils &RandomEngine,
+                      const ObfuscationOptions *Options, StringRef PassName,
+                      const Module &M, const Function *F = nullptr);
 uint64_t getRandomNumber();
 std::string& linkCurrentModuleSource();
 
@@ -1,5 +1,7 @@
 #include "llvm/Transforms/Obfuscation/BogusControlFlow2.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
@@ -7,6 +9,17 @@
 
 using namespace llvm;
 
+static cl::opt<bool>
+    BogusJunkBlocks("irobf-bcf-junk", cl::init(false), cl::NotHidden,
+                    cl::desc("Use small junk blocks instead of cloned bodies "
+                             "as the never taken successor"),
+                    cl::ZeroOrMore);
+
+static cl::opt<unsigned>
+    BogusJunkSize("irobf-bcf-junk-size", cl::init(6), cl::NotHidden,
+                  cl::desc("Maximum number of instructions in a junk block"),
+                  cl::ZeroOrMore);
+
 namespace polaris {
 
 BasicBlock *cloneBasicBlock(BasicBlock *BB) {
@@ -34,31 +47,157 @@ BasicBlock *cloneBasicBlock(BasicBlock *BB) {
   return cloneBB;
 }
 
-Value *createBogusCmp(BasicBlock *insertAfter) {
-  // if((y < 10 || x * (x + 1) % 2 == 0))
-  Module *M = insertAfter->getModule();
-  LLVMContext &context = M->getContext();
-  GlobalVariable *xptr = new GlobalVariable(
-      *M, Type::getInt32Ty(context), false, GlobalValue::CommonLinkage,
-      ConstantInt::get(Type::getInt32Ty(context), 0), "x");
-  GlobalVariable *yptr = new GlobalVariable(
-      *M, Type::getInt32Ty(context), false, GlobalValue::CommonLinkage,
-      ConstantInt::get(Type::getInt32Ty(context), 0), "y");
-
-  IRBuilder<> builder(context);
-  builder.SetInsertPoint(insertAfter);
-  LoadInst *x = builder.CreateLoad(Type::getInt32Ty(context), xptr);
-  LoadInst *y = builder.CreateLoad(Type::getInt32Ty(context), yptr);
-  Value *cond1 =
-      builder.CreateICmpSLT(y, ConstantInt::get(Type::getInt32Ty(context), 10));
-  Value *op1 =
-      builder.CreateAdd(x, ConstantInt::get(Type::getInt32Ty(context), 1));
-  Value *op2 = builder.CreateMul(op1, x);
-  Value *op3 =
-      builder.CreateURem(op2, ConstantInt::get(Type::getInt32Ty(context), 2));
-  Value *cond2 =
-      builder.CreateICmpEQ(op3, ConstantInt::get(Type::getInt32Ty(context), 0));
-  return BinaryOperator::CreateOr(cond1, cond2, "", insertAfter);
+BasicBlock *createJunkBlock(BasicBlock *headBB, BasicBlock *bodyBB,
+                            GlobalVariable *sink, unsigned maxSize,
+                            CryptoUtils &RandomEngine) {
+  Function *F = headBB->getParent();
+  LLVMContext &context = F->getContext();
+  Type *Int32Ty = Type::getInt32Ty(context);
+  BasicBlock *junkBB = BasicBlock::Create(context, "junkBB", F, bodyBB);
+  IRBuilder<> builder(junkBB);
+
+  // Only values that dominate both predecessors (headBB and bodyBB)
+  SmallVector<Value *, 8> pool;
+  pool.push_back(builder.CreateLoad(Int32Ty, sink));
+  for (Argument &A : F->args()) {
+    if (A.getType()->isIntegerTy())
+      pool.push_back(&A);
+  }
+  for (PHINode &PN : headBB->phis()) {
+    if (PN.getType()->isIntegerTy())
+      pool.push_back(&PN);
+  }
+
+  auto pick = [&]() {
+    Value *V = pool[RandomEngine.get_range(pool.size())];
+    return builder.CreateZExtOrTrunc(V, Int32Ty);
+  };
+
+  static const Instruction::BinaryOps ops[] = {
+      Instruction::Add, Instruction::Sub, Instruction::Xor, Instruction::Mul,
+      Instruction::Or,  Instruction::And, Instruction::Shl};
+  Value *result = pick();
+  // Each step adds at most a cast and the operation, leave room for the
+  // store and the branch
+  while (junkBB->size() + 4 <= maxSize) {
+    Instruction::BinaryOps op = ops[RandomEngine.get_range(std::size(ops))];
+    Value *rhs = RandomEngine.get_range(2)
+                     ? pick()
+                     : ConstantInt::get(Int32Ty, RandomEngine.get_uint8_t());
+    if (op == Instruction::Shl)
+      rhs = ConstantInt::get(Int32Ty, RandomEngine.get_range(31) + 1);
+    result = builder.CreateBinOp(op, result, rhs);
+    pool.push_back(result);
+  }
+
+  // The store keeps the arithmetic alive, the block never runs
+  builder.CreateStore(result, sink);
+  builder.CreateBr(bodyBB);
+  return junkBB;
+}
+
+// Every predicate is some form of x * (x + 1) being even, which holds for any
+// x, so it does not matter what the opaque globals end up holding at link
+// time. The forms differ in how much they cost on the path they guard.
+enum PredicateKind {
+  PK_Hoisted, // i1 computed once in the entry block, cost 1
+  PK_Argument, // recomputed from an integer argument, cost 3
+  PK_Entry,    // recomputed from x loaded once in the entry block, cost 3
+  PK_Memory,   // fresh loads of x and y, cost 6
+  PK_Count
+};
+
+static const unsigned PredicateCost[PK_Count] = {1, 3, 3, 6};
+
+OpaquePredicates::OpaquePredicates(Function &F, GlobalVariable *X,
+                                   GlobalVariable *Y, CryptoUtils &RandomEngine)
+    : F(F), XPtr(X), YPtr(Y), RandomEngine(RandomEngine) {
+  for (Argument &A : F.args()) {
+    if (A.getType()->isIntegerTy() && A.getType()->getIntegerBitWidth() >= 8)
+      IntArgs.push_back(&A);
+  }
+}
+
+GlobalVariable *OpaquePredicates::createGlobal(Module &M, StringRef Name) {
+  // Common linkage keeps the optimizer from folding the loads
+  return new GlobalVariable(M, Type::getInt32Ty(M.getContext()), false,
+                            GlobalValue::CommonLinkage,
+                            ConstantInt::get(Type::getInt32Ty(M.getContext()), 0),
+                            Name);
+}
+
+Value *OpaquePredicates::loadEntryX() {
+  if (!EntryX) {
+    BasicBlock &Entry = F.getEntryBlock();
+    IRBuilder<> builder(&Entry, Entry.getFirstInsertionPt());
+    EntryX = builder.CreateLoad(XPtr->getValueType(), XPtr);
+  }
+  return EntryX;
+}
+
+Value *OpaquePredicates::createEvenProduct(IRBuilder<> &builder, Value *V) {
+  // x * (x + 1) & 1 == 0, or x * (x - 1)
+  Constant *One = ConstantInt::get(V->getType(), 1);
+  Value *Next = RandomEngine.get_range(2) ? builder.CreateAdd(V, One)
+                                         : builder.CreateSub(V, One);
+  Value *Prod = builder.CreateMul(V, Next);
+  return builder.CreateICmpEQ(builder.CreateAnd(Prod, One),
+                              ConstantInt::get(V->getType(), 0));
+}
+
+Value *OpaquePredicates::create(BasicBlock *insertAfter, bool hot) {
+  SmallVector<PredicateKind, PK_Count> Kinds;
+  for (unsigned K = 0; K < PK_Count; ++K) {
+    if (K == PK_Argument && IntArgs.empty())
+      continue;
+    Kinds.push_back((PredicateKind)K);
+  }
+  // Hot blocks only get the cheapest form
+  if (hot) {
+    unsigned MinCost = PredicateCost[Kinds.front()];
+    for (PredicateKind K : Kinds)
+      MinCost = std::min(MinCost, PredicateCost[K]);
+    llvm::erase_if(Kinds,
+                   [&](PredicateKind K) { return PredicateCost[K] != MinCost; });
+  }
+  PredicateKind Kind = Kinds[RandomEngine.get_range(Kinds.size())];
+
+  LLVMContext &context = F.getContext();
+  switch (Kind) {
+  case PK_Hoisted:
+    if (!HoistedCond) {
+      Instruction *X = cast<Instruction>(loadEntryX());
+      IRBuilder<> builder(X->getParent(), std::next(X->getIterator()));
+      HoistedCond = createEvenProduct(builder, X);
+    }
+    return HoistedCond;
+  case PK_Argument: {
+    IRBuilder<> builder(insertAfter);
+    return createEvenProduct(builder,
+                             IntArgs[RandomEngine.get_range(IntArgs.size())]);
+  }
+  case PK_Entry: {
+    Value *X = loadEntryX();
+    IRBuilder<> builder(insertAfter);
+    return createEvenProduct(builder, X);
+  }
+  default: {
+    // if((y < 10 || x * (x + 1) % 2 == 0))
+    IRBuilder<> builder(insertAfter);
+    LoadInst *x = builder.CreateLoad(Type::getInt32Ty(context), XPtr);
+    LoadInst *y = builder.CreateLoad(Type::getInt32Ty(context), YPtr);
+    Value *cond1 = builder.CreateICmpSLT(
+        y, ConstantInt::get(Type::getInt32Ty(context), 10));
+    Value *op1 =
+        builder.CreateAdd(x, ConstantInt::get(Type::getInt32Ty(context), 1));
+    Value *op2 = builder.CreateMul(op1, x);
+    Value *op3 = builder.CreateURem(
+        op2, ConstantInt::get(Type::getInt32Ty(context), 2));
+    Value *cond2 = builder.CreateICmpEQ(
+        op3, ConstantInt::get(Type::getInt32Ty(context), 0));
+    return builder.CreateOr(cond1, cond2);
+  }
+  }
 }
 
 }; // namespace polaris
@@ -67,15 +206,38 @@ using namespace polaris;
 
 struct BogusControlFlow2Pass : public FunctionPass {
   ObfuscationOptions *ArgsOptions;
+  CryptoUtils RandomEngine;
   static char ID;
 
+  // Opaque globals shared by every function of the module
+  Module *CurrentModule = nullptr;
+  GlobalVariable *OpaqueX = nullptr;
+  GlobalVariable *OpaqueY = nullptr;
+
   BogusControlFlow2Pass(ObfuscationOptions *ArgsOptions) : FunctionPass(ID), ArgsOptions(ArgsOptions) {}
 
+  StringRef getPassName() const override { return {"BogusControlFlow"}; }
+
   bool runOnFunction(Function &Fn) override {
     const auto opt = ArgsOptions->toObfuscate(ArgsOptions->bcfOpt(), &Fn);
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *Fn.getParent(), &Fn);
+
+    // Decide before splitting, the new blocks are not classified
+    HotnessInfo Hotness(Fn);
+    if (Hotness.skipFunction()) {
+      return false;
+    }
+
+    if (CurrentModule != Fn.getParent()) {
+      CurrentModule = Fn.getParent();
+      OpaqueX = OpaquePredicates::createGlobal(*CurrentModule, "x");
+      OpaqueY = OpaquePredicates::createGlobal(*CurrentModule, "y");
+    }
+    OpaquePredicates predicates(Fn, OpaqueX, OpaqueY, RandomEngine);
 
     std::vector<BasicBlock *> origBB;
     for (BasicBlock &BB : Fn) {
@@ -85,7 +247,8 @@ struct BogusControlFlow2Pass : public FunctionPass {
     bool changed = false;
     for (BasicBlock *BB : origBB) {
       if (isa<InvokeInst>(BB->getTerminator()) || BB->isEHPad() ||
-          (getRandomNumber() % 100) <= 100 - opt.level()) {
+          Hotness.skip(BB) ||
+          RandomEngine.get_range(100) <= 100 - opt.level()) {
         continue;
       }
       BasicBlock *headBB = BB;
@@ -93,18 +256,27 @@ struct BogusControlFlow2Pass : public FunctionPass {
           BB->splitBasicBlock(BB->getFirstNonPHIOrDbgOrLifetime(), "bodyBB");
       BasicBlock *tailBB =
           bodyBB->splitBasicBlock(bodyBB->getTerminator(), "endBB");
-      BasicBlock *cloneBB = cloneBasicBlock(bodyBB);
+      BasicBlock *cloneBB =
+          BogusJunkBlocks
+              ? createJunkBlock(headBB, bodyBB, OpaqueX, BogusJunkSize,
+                                RandomEngine)
+              : cloneBasicBlock(bodyBB);
 
       BB->getTerminator()->eraseFromParent();
       bodyBB->getTerminator()->eraseFromParent();
-      cloneBB->getTerminator()->eraseFromParent();
+      if (!BogusJunkBlocks) {
+        cloneBB->getTerminator()->eraseFromParent();
+      }
 
-      Value *cond1 = createBogusCmp(BB);
-      Value *cond2 = createBogusCmp(bodyBB);
+      bool hot = Hotness.isHot(BB);
+      Value *cond1 = predicates.create(BB, hot);
+      Value *cond2 = predicates.create(bodyBB, hot);
 
-      BranchInst::Create(bodyBB, cloneBB, cond1, BB);
-      BranchInst::Create(tailBB, cloneBB, cond2, bodyBB);
-      BranchInst::Create(bodyBB, cloneBB);
+      setUnlikelySuccessor(BranchInst::Create(bodyBB, cloneBB, cond1, BB), 1);
+      setUnlikelySuccessor(BranchInst::Create(tailBB, cloneBB, cond2, bodyBB), 1);
+      if (!BogusJunkBlocks) {
+        BranchInst::Create(bodyBB, cloneBB);
+      }
 
       changed = true;
     }
@@ -1,5 +1,7 @@
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 #include "llvm/Transforms/Obfuscation/ConstantFPEncryption.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
 #include "llvm/Transforms/IPO/Attributor.h"
@@ -11,7 +13,6 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/IR/NoFolder.h"
-#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <map>
 #include <set>
 #include <iostream>
@@ -57,7 +58,7 @@ struct ConstantFPEncryption : public FunctionPass {
                                        GlobalValue::LinkageTypes::PrivateLinkage,
                                        Enc);
 
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
     const auto Add = IRB.CreateAdd(Key, Load);
@@ -91,12 +92,12 @@ struct ConstantFPEncryption : public FunctionPass {
     auto       GV = new GlobalVariable(*Module, Enc->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -133,12 +134,12 @@ struct ConstantFPEncryption : public FunctionPass {
     auto       GV = new GlobalVariable(*Module, Enc->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -180,12 +181,12 @@ struct ConstantFPEncryption : public FunctionPass {
     auto       GV = new GlobalVariable(*Module, Enc->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
       GlobalValue::LinkageTypes::PrivateLinkage,
       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -206,10 +207,19 @@ struct ConstantFPEncryption : public FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *F.getParent(), &F);
 
+    HotnessInfo Hotness(F, /*SkipOnly=*/true);
+    if (Hotness.skipFunction()) {
+      return false;
+    }
     bool Changed = expandConstantExpr(F);
 
     for (auto &BB : F) {
+      if (Hotness.skip(&BB)) {
+        continue;
+      }
       for (auto &I : BB) {
         if (I.isEHPad() || isa<AllocaInst>(&I) || isa<IntrinsicInst>(&I) ||
             isa<SwitchInst>(&I) || I.isAtomic()) {
@@ -1,5 +1,7 @@
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 #include "llvm/Transforms/Obfuscation/ConstantIntEncryption.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
 #include "llvm/Transforms/IPO/Attributor.h"
@@ -11,7 +13,6 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/IR/NoFolder.h"
-#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <map>
 #include <set>
 #include <iostream>
@@ -32,6 +33,10 @@ struct ConstantIntEncryption : public FunctionPass {
     this->ArgsOptions = argsOptions;
   }
 
+  StringRef getPassName() const override {
+    return {"ConstantIntEncryption"};
+  }
+
   Value *createConstantIntEncrypt0(BasicBlock::iterator ip, ConstantInt *CIT) {
     const auto          Module = ip->getModule();
     IRBuilder<NoFolder> IRB(ip->getContext());
@@ -43,7 +48,7 @@ struct ConstantIntEncryption : public FunctionPass {
     auto       GV = new GlobalVariable(*Module, Enc->getType(), false,
                                        GlobalValue::LinkageTypes::PrivateLinkage,
                                        Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
     const auto NewOpr = IRB.CreateAdd(Key, Load);
@@ -66,12 +71,12 @@ struct ConstantIntEncryption : public FunctionPass {
     auto GV = new GlobalVariable(*Module, Enc->getType(), false,
                                  GlobalValue::LinkageTypes::PrivateLinkage,
                                  Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
                                       GlobalValue::LinkageTypes::PrivateLinkage,
                                       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -99,12 +104,12 @@ struct ConstantIntEncryption : public FunctionPass {
     auto GV = new GlobalVariable(*Module, Enc->getType(), false,
                                  GlobalValue::LinkageTypes::PrivateLinkage,
                                  Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
                                       GlobalValue::LinkageTypes::PrivateLinkage,
                                       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -137,12 +142,12 @@ struct ConstantIntEncryption : public FunctionPass {
     auto GV = new GlobalVariable(*Module, Enc->getType(), false,
                                  GlobalValue::LinkageTypes::PrivateLinkage,
                                  Enc);
-    appendToCompilerUsed(*Module, {GV});
+    registerObfuscationData(GV, ip->getFunction());
 
     auto GXorKey = new GlobalVariable(*Module, XorKey->getType(), false,
                                       GlobalValue::LinkageTypes::PrivateLinkage,
                                       XorKey);
-    appendToCompilerUsed(*Module, {GXorKey});
+    registerObfuscationData(GXorKey, ip->getFunction());
 
     // outs() << I << " ->\n";
     const auto Load = IRB.CreateLoad(Enc->getType(), GV);
@@ -162,10 +167,19 @@ struct ConstantIntEncryption : public FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *F.getParent(), &F);
 
+    HotnessInfo Hotness(F, /*SkipOnly=*/true);
+    if (Hotness.skipFunction()) {
+      return false;
+    }
     bool Changed = expandConstantExpr(F);
 
     for (auto &BB : F) {
+      if (Hotness.skip(&BB)) {
+        continue;
+      }
       for (auto &I : BB) {
         if (I.isEHPad() || isa<AllocaInst>(&I) || isa<IntrinsicInst>(&I) ||
             isa<SwitchInst>(&I) || I.isAtomic()) {
@@ -22,7 +22,6 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
-#include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <cassert>
@@ -37,6 +36,12 @@
 #include <fstream>
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRYPTOUTILS_X86_DISPATCH
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 // Stats
 #define DEBUG_TYPE "CryptoUtils"
 STATISTIC(statsGetBytes, "a. Number of calls to get_bytes ()");
@@ -45,15 +50,11 @@ STATISTIC(statsGetUint8, "c. Number of calls to get_uint8_t ()");
 STATISTIC(statsGetUint32, "d. Number of calls to get_uint32_t ()");
 STATISTIC(statsGetUint64, "e. Number of calls to get_uint64_t ()");
 STATISTIC(statsGetRange, "f. Number of calls to get_range ()");
-STATISTIC(statsPopulate, "g. Number of calls to populate ()");
+STATISTIC(statsPopulate, "g. Number of keystream blocks generated");
 STATISTIC(statsAESEncrypt, "h. Number of calls to aes_encrypt ()");
 
 using namespace llvm;
 
-namespace llvm {
-ManagedStatic<CryptoUtils> cryptoutils;
-}
-
 const uint32_t AES_RCON[10] = {
     0x01000000UL, 0x02000000UL, 0x04000000UL, 0x08000000UL, 0x10000000UL,
     0x20000000UL, 0x40000000UL, 0x80000000UL, 0x1b000000UL, 0x36000000UL};
@@ -499,7 +500,117 @@ const uint32_t masks[32] = {
     0x00000040UL, 0x00000020UL, 0x00000010UL, 0x00000008UL, 0x00000004UL,
     0x00000002UL, 0x00000001UL};
 
-CryptoUtils::CryptoUtils() { seeded = false; }
+#ifdef CRYPTOUTILS_X86_DISPATCH
+// Runtime dispatch to AES-NI / SHA-NI on x86-64 hosts. Both paths produce
+// exactly the same output as the table-driven code below, which remains the
+// fallback on every other host.
+namespace {
+struct HostCryptoFeatures {
+  bool AES = false;
+  bool SHA = false;
+
+  HostCryptoFeatures() {
+    unsigned EAX, EBX, ECX, EDX;
+    if (!__get_cpuid(1, &EAX, &EBX, &ECX, &EDX))
+      return;
+    bool SSSE3 = ECX & bit_SSSE3;
+    bool SSE41 = ECX & bit_SSE4_1;
+    AES = (ECX & bit_AES) && SSSE3;
+    if (__get_cpuid_count(7, 0, &EAX, &EBX, &ECX, &EDX))
+      SHA = (EBX & (1u << 29)) && SSSE3 && SSE41;
+  }
+};
+} // namespace
+
+static const HostCryptoFeatures &getHostCryptoFeatures() {
+  static const HostCryptoFeatures Features;
+  return Features;
+}
+
+// The key schedule holds big-endian words, so each round key needs a
+// byte swap within its 32-bit lanes before it can feed aesenc.
+__attribute__((target("aes,ssse3"))) static void
+aes_encrypt_ni(char *out, const char *in, const uint32_t *ks) {
+  const __m128i Swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7,
+                                    0, 1, 2, 3);
+  __m128i State = _mm_loadu_si128((const __m128i *)in);
+
+  State = _mm_xor_si128(
+      State, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ks), Swap));
+  for (int r = 1; r < 10; r++) {
+    State = _mm_aesenc_si128(
+        State,
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(ks + 4 * r)), Swap));
+  }
+  State = _mm_aesenclast_si128(
+      State,
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(ks + 40)), Swap));
+
+  _mm_storeu_si128((__m128i *)out, State);
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha256_compress_ni(uint32_t *state, const unsigned char *buf) {
+  const __m128i Swap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i State0, State1, Tmp, Msg, Save0, Save1;
+  __m128i W[4];
+
+  // Rearrange A..H into the ABEF / CDGH layout sha256rnds2 expects
+  Tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+  State1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+  State0 = _mm_alignr_epi8(Tmp, State1, 8);
+  State1 = _mm_blend_epi16(State1, Tmp, 0xF0);
+  Save0 = State0;
+  Save1 = State1;
+
+  for (int i = 0; i < 16; i++) {
+    if (i < 4) {
+      W[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(buf + 16 * i)), Swap);
+    } else {
+      // W[i..i+3] from W[i-16..i-1], four words at a time
+      W[i & 3] = _mm_sha256msg2_epu32(
+          _mm_add_epi32(_mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]),
+                        _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4)),
+          W[(i + 3) & 3]);
+    }
+    Msg = _mm_add_epi32(W[i & 3],
+                        _mm_loadu_si128((const __m128i *)&SHA256_K[4 * i]));
+    State1 = _mm_sha256rnds2_epu32(State1, State0, Msg);
+    State0 = _mm_sha256rnds2_epu32(State0, State1, _mm_shuffle_epi32(Msg, 0x0E));
+  }
+
+  State0 = _mm_add_epi32(State0, Save0);
+  State1 = _mm_add_epi32(State1, Save1);
+
+  // Back to A..H
+  Tmp = _mm_shuffle_epi32(State0, 0x1B);
+  State1 = _mm_shuffle_epi32(State1, 0xB1);
+  State0 = _mm_blend_epi16(Tmp, State1, 0xF0);
+  State1 = _mm_alignr_epi8(State1, Tmp, 8);
+  _mm_storeu_si128((__m128i *)&state[0], State0);
+  _mm_storeu_si128((__m128i *)&state[4], State1);
+}
+#endif
+
+CryptoUtils::CryptoUtils() {
+  seeded = false;
+  idx = sizeof(block);
+}
 
 unsigned CryptoUtils::scramble32(const unsigned in, const char key[16]) {
   assert(key != NULL && "CryptoUtils::scramble key=NULL");
@@ -620,10 +731,9 @@ void CryptoUtils::prng_seed(const std::string _seed) {
 
   seeded = true;
 
-  // We are now ready to fill the pool with
-  // cryptographically secure pseudo-random
-  // values.
-  populate_pool();
+  // Keystream blocks are generated lazily,
+  // on the first request for random bytes.
+  idx = sizeof(block);
 }
 
 CryptoUtils::~CryptoUtils() {
@@ -631,23 +741,20 @@ CryptoUtils::~CryptoUtils() {
   memset(key, 0, 16);
   memset(ks, 0, 44 * sizeof(uint32_t));
   memset(ctr, 0, 16);
-  memset(pool, 0, CryptoUtils_POOL_SIZE);
+  memset(block, 0, sizeof(block));
 
-  idx = 0;
+  idx = sizeof(block);
 }
 
-void CryptoUtils::populate_pool() {
+void CryptoUtils::refill_block() {
 
   statsPopulate++;
 
-  for (int i = 0; i < CryptoUtils_POOL_SIZE; i += 16) {
-
-    // ctr += 1
-    inc_ctr();
+  // ctr += 1
+  inc_ctr();
 
-    // We then encrypt the counter
-    aes_encrypt(pool + i, ctr, ks);
-  }
+  // We then encrypt the counter
+  aes_encrypt(block, ctr, ks);
 
   // Reinitializing the index of the first
   // available pseudo-random byte
@@ -729,24 +836,19 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
     // If the PRNG is not seeded, it the very last time to do it !
     if (!seeded) {
       prng_seed();
-      populate_pool();
+      idx = sizeof(block);
     }
 
-    do {
-      if (idx + (len - sofar) >= CryptoUtils_POOL_SIZE) {
-        // We don't have enough bytes ready in the pool,
-        // so let's use the available ones and repopulate !
-        available = CryptoUtils_POOL_SIZE - idx;
-        memcpy(buffer + sofar, pool + idx, available);
-        sofar += available;
-        populate_pool();
-      } else {
-        memcpy(buffer + sofar, pool + idx, len - sofar);
-        idx += len - sofar;
-        // This will trigger a loop exit
-        sofar = len;
+    while (sofar < len) {
+      if (idx == sizeof(block)) {
+        // The current block is exhausted, encrypt the next counter
+        refill_block();
       }
-    } while (sofar < (len - 1));
+      available = MIN((int)(sizeof(block) - idx), len - sofar);
+      memcpy(buffer + sofar, block + idx, available);
+      idx += available;
+      sofar += available;
+    }
   }
 }
 
@@ -861,6 +963,13 @@ void CryptoUtils::aes_encrypt(char *out, const char *in, const uint32_t *ks) {
 
   statsAESEncrypt++;
 
+#ifdef CRYPTOUTILS_X86_DISPATCH
+  if (getHostCryptoFeatures().AES) {
+    aes_encrypt_ni(out, in, ks);
+    return;
+  }
+#endif
+
   r = 0;
   LOAD32H(state0, in + 0);
   LOAD32H(state1, in + 4);
@@ -957,6 +1066,13 @@ int CryptoUtils::sha256_compress(sha256_state *md, unsigned char *buf) {
   uint32_t S[8], W[64], t0, t1;
   int i;
 
+#ifdef CRYPTOUTILS_X86_DISPATCH
+  if (getHostCryptoFeatures().SHA) {
+    sha256_compress_ni(md->state, buf);
+    return 0;
+  }
+#endif
+
   /* copy state into S */
   for (i = 0; i < 8; i++) {
     S[i] = md->state[i];
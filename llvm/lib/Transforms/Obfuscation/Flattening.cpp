@@ -11,9 +11,16 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Obfuscation/Flattening.h"
 #include "llvm/Transforms/Obfuscation/LegacyLowerSwitch.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/ADT/Statistic.h"
@@ -24,8 +31,16 @@
 using namespace std;
 using namespace llvm;
 
+static cl::opt<bool>
+    KeepSwitchJumpTables("irobf-fla-keep-switch", cl::init(false),
+                         cl::NotHidden,
+                         cl::desc("Keep dense switches when flattening and "
+                                  "update the state through a lookup table"),
+                         cl::ZeroOrMore);
+
 // Stats
 STATISTIC(Flattened, "Functions flattened");
+STATISTIC(KeptSwitches, "Switches kept as lookup tables");
 
 namespace {
 struct Flattening : public FunctionPass {
@@ -40,8 +55,14 @@ struct Flattening : public FunctionPass {
     this->ArgsOptions = argsOptions;
   }
 
+  StringRef getPassName() const override { return {"Flattening"}; }
+
   bool runOnFunction(Function &F) override;
   bool flatten(Function *f, const ObfOpt& opt);
+  ConstantInt *getCaseNumber(SwitchInst *switchI, BasicBlock *succ,
+                             char *scrambling_key);
+  Value *createSwitchLookup(SwitchInst *SI, SwitchInst *switchI,
+                            char *scrambling_key);
 };
 }
 
@@ -53,6 +74,12 @@ bool Flattening::runOnFunction(Function &F) {
   if (!opt.isEnabled()) {
     return result;
   }
+  seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                   *F.getParent(), &F);
+  // There is no cheap way to flatten, hot functions are left alone
+  if (HotnessInfo(F).function() != ObfHotness::Normal) {
+    return result;
+  }
   if (flatten(tmp, opt)) {
       ++Flattened;
       result = true;
@@ -71,12 +98,13 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
 
   // SCRAMBLER
   char scrambling_key[16];
-  llvm::cryptoutils->get_bytes(scrambling_key, 16);
+  RandomEngine.get_bytes(scrambling_key, 16);
   // END OF SCRAMBLER
 
-  // Lower switch
-  FunctionPass *lower = createLegacyLowerSwitchPass();
+  // Lower switch, dense ones are kept and dispatched through a lookup table
+  FunctionPass *lower = createLegacyLowerSwitchPass(KeepSwitchJumpTables);
   lower->runOnFunction(*f);
+  delete(lower);
 
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
@@ -94,6 +122,17 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
     return false;
   }
 
+  // Remember block frequencies so that the dispatcher is lowered hot first
+  DenseMap<BasicBlock *, uint64_t> BlockFreq;
+  if (f->hasProfileData()) {
+    DominatorTree DT(*f);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(*f, LI);
+    BlockFrequencyInfo BFI(*f, BPI, LI);
+    for (BasicBlock &BB : *f)
+      BlockFreq[&BB] = BFI.getBlockFreq(&BB).getFrequency();
+  }
+
   LLVMContext &Ctx = f->getContext();
   IntegerType* intType = Type::getInt32Ty(Ctx);
   if (pointerSize == 8) {
@@ -137,12 +176,12 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
   if (pointerSize == 8) {
     new StoreInst(
       ConstantInt::get(intType,
-        llvm::cryptoutils->scramble64(0, scrambling_key)),
+        RandomEngine.scramble64(0, scrambling_key)),
       switchVar, insert);
   } else {
     new StoreInst(
       ConstantInt::get(intType,
-        llvm::cryptoutils->scramble32(0, scrambling_key)),
+        RandomEngine.scramble32(0, scrambling_key)),
       switchVar, insert);
   }
 
@@ -185,15 +224,27 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
     if (pointerSize == 8) {
       numCase = cast<ConstantInt>(ConstantInt::get(
           switchI->getCondition()->getType(),
-          llvm::cryptoutils->scramble64(switchI->getNumCases(), scrambling_key)));
+          RandomEngine.scramble64(switchI->getNumCases(), scrambling_key)));
     } else {
       numCase = cast<ConstantInt>(ConstantInt::get(
         switchI->getCondition()->getType(),
-        llvm::cryptoutils->scramble32(switchI->getNumCases(), scrambling_key)));
+        RandomEngine.scramble32(switchI->getNumCases(), scrambling_key)));
     }
     switchI->addCase(numCase, i);
   }
 
+  // switchDefault is never taken. Lowering the dispatcher gives every leaf
+  // compare a share of its weight, so it stays off the hot path there too
+  if (!BlockFreq.empty()) {
+    // "first" inherits the entry frequency
+    SmallVector<uint64_t, 64> Weights = {1};
+    for (BasicBlock *BB : origBB)
+      Weights.push_back(BlockFreq.count(BB) ? BlockFreq[BB] : BlockFreq[insert]);
+    setScaledBranchWeights(switchI, Weights);
+  } else {
+    setUnlikelySuccessor(switchI, 0);
+  }
+
   ConstantInt *Zero = ConstantInt::get(intType, 0);
   // Recalculate switchVar
   for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
@@ -206,6 +257,18 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
       continue;
     }
 
+    // If it's a switch kept for its jump table
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(i->getTerminator())) {
+      Value *newNumCase = createSwitchLookup(SI, switchI, scrambling_key);
+      SI->eraseFromParent();
+
+      // Update switchVar and jump to the end of loop
+      new StoreInst(newNumCase, load->getPointerOperand(), i);
+      BranchInst::Create(loopEnd, i);
+      ++KeptSwitches;
+      continue;
+    }
+
     // If it's a non-conditional jump
     if (i->getTerminator()->getNumSuccessors() == 1) {
       // Get successor and delete terminator
@@ -220,12 +283,12 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
         if (pointerSize == 8) {
           numCase = cast<ConstantInt>(
               ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
+                               RandomEngine.scramble64(
                                    switchI->getNumCases() - 1, scrambling_key)));
         } else {
           numCase = cast<ConstantInt>(
             ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
+              RandomEngine.scramble32(
                 switchI->getNumCases() - 1, scrambling_key)));
         }
       }
@@ -254,12 +317,12 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
         if (pointerSize == 8) {
           numCaseTrue = cast<ConstantInt>(
               ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
+                               RandomEngine.scramble64(
                                    switchI->getNumCases() - 1, scrambling_key)));
         } else {
           numCaseTrue = cast<ConstantInt>(
             ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
+              RandomEngine.scramble32(
                 switchI->getNumCases() - 1, scrambling_key)));
         }
       }
@@ -268,12 +331,12 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
         if (pointerSize == 8) {
           numCaseFalse = cast<ConstantInt>(
               ConstantInt::get(switchI->getCondition()->getType(),
-                               llvm::cryptoutils->scramble64(
+                               RandomEngine.scramble64(
                                    switchI->getNumCases() - 1, scrambling_key)));
         } else {
           numCaseFalse = cast<ConstantInt>(
             ConstantInt::get(switchI->getCondition()->getType(),
-              llvm::cryptoutils->scramble32(
+              RandomEngine.scramble32(
                 switchI->getNumCases() - 1, scrambling_key)));
         }
       }
@@ -302,12 +365,83 @@ bool Flattening::flatten(Function *f, const ObfOpt& opt) {
 
   fixStack(f);
 
+  // Lower the dispatcher
+  lower = createLegacyLowerSwitchPass();
   lower->runOnFunction(*f);
   delete(lower);
 
   return true;
 }
 
+ConstantInt *Flattening::getCaseNumber(SwitchInst *switchI, BasicBlock *succ,
+                                       char *scrambling_key) {
+  ConstantInt *numCase = switchI->findCaseDest(succ);
+
+  // If next case == default case (switchDefault)
+  if (numCase == NULL) {
+    uint64_t idx = switchI->getNumCases() - 1;
+    numCase = cast<ConstantInt>(ConstantInt::get(
+        switchI->getCondition()->getType(),
+        pointerSize == 8 ? RandomEngine.scramble64(idx, scrambling_key)
+                         : RandomEngine.scramble32(idx, scrambling_key)));
+  }
+  return numCase;
+}
+
+// Map the condition of a dense switch to the next dispatcher state through
+// an xor-encoded table, one entry per case value plus a trailing default
+// entry, so the state update stays O(1) like the original jump table.
+Value *Flattening::createSwitchLookup(SwitchInst *SI, SwitchInst *switchI,
+                                      char *scrambling_key) {
+  IntegerType *intType = cast<IntegerType>(switchI->getCondition()->getType());
+  IntegerType *condType = cast<IntegerType>(SI->getCondition()->getType());
+
+  APInt Low = SI->case_begin()->getCaseValue()->getValue();
+  APInt High = Low;
+  for (auto Case : SI->cases()) {
+    const APInt &V = Case.getCaseValue()->getValue();
+    if (V.slt(Low))
+      Low = V;
+    if (V.sgt(High))
+      High = V;
+  }
+  uint64_t Range = (High - Low).getZExtValue() + 1;
+
+  uint64_t TableKey = RandomEngine.get_uint64_t();
+  ConstantInt *Key = cast<ConstantInt>(ConstantInt::get(intType, TableKey));
+  ConstantInt *DefaultCase =
+      getCaseNumber(switchI, SI->getDefaultDest(), scrambling_key);
+
+  std::vector<Constant *> Entries(Range + 1, ConstantExpr::getXor(DefaultCase, Key));
+  for (auto Case : SI->cases()) {
+    uint64_t Idx = (Case.getCaseValue()->getValue() - Low).getZExtValue();
+    ConstantInt *numCase =
+        getCaseNumber(switchI, Case.getCaseSuccessor(), scrambling_key);
+    Entries[Idx] = ConstantExpr::getXor(numCase, Key);
+  }
+
+  Function *F = SI->getFunction();
+  ArrayType *ATy = ArrayType::get(intType, Entries.size());
+  GlobalVariable *Table = new GlobalVariable(
+      *F->getParent(), ATy, true, GlobalValue::LinkageTypes::PrivateLinkage,
+      ConstantArray::get(ATy, Entries), F->getName() + "_FlaSwitchTable");
+  Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  // Out of range values read the trailing default entry. The range can be
+  // 2^bitwidth of the condition (i1, a full i8 opcode space), so compare in
+  // i64 where it cannot wrap to 0
+  IRBuilder<> IRB(SI);
+  Value *Off = IRB.CreateSub(SI->getCondition(), ConstantInt::get(condType, Low));
+  Value *WideOff = IRB.CreateZExt(Off, IRB.getInt64Ty());
+  Value *InRange = IRB.CreateICmpULT(WideOff, IRB.getInt64(Range));
+  Value *Idx = IRB.CreateTrunc(
+      IRB.CreateSelect(InRange, WideOff, IRB.getInt64(Range)), intType);
+  Value *EntryAddr =
+      IRB.CreateGEP(ATy, Table, {ConstantInt::get(intType, 0), Idx});
+  Value *Entry = IRB.CreateLoad(intType, EntryAddr);
+  return IRB.CreateXor(Entry, Key);
+}
+
 char Flattening::ID = 0;
 static RegisterPass<Flattening> X("flattening", "Call graph flattening");
 FunctionPass *llvm::createFlatteningPass(unsigned pointerSize, ObfuscationOptions *argsOptions) {
@@ -0,0 +1,146 @@
+#include "llvm/Transforms/Obfuscation/Hotness.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+namespace {
+enum class HotnessMode { Loops, Profile, Static };
+}
+
+static cl::opt<HotnessMode> ObfHotnessMode(
+    "irobf-hotness", cl::init(HotnessMode::Loops), cl::NotHidden,
+    cl::desc("Where the obfuscation passes take code hotness from"),
+    cl::values(
+        clEnumValN(HotnessMode::Loops, "loops",
+                   "Blocks inside loops are hot"),
+        clEnumValN(HotnessMode::Profile, "profile",
+                   "Use the PGO or sample profile counts, falling back to "
+                   "loops for functions without profile data"),
+        clEnumValN(HotnessMode::Static, "static",
+                   "Estimate from loop depth, branch probabilities "
+                   "(including __builtin_expect) and the hot, cold and "
+                   "minsize attributes")),
+    cl::ZeroOrMore);
+
+static cl::opt<int> HotPercentile(
+    "irobf-hot-percentile", cl::init(990000), cl::NotHidden,
+    cl::desc("With -irobf-hotness=profile, functions and blocks within this "
+             "percentile of the profile counts (out of 1000000) only get the "
+             "cheapest transforms"),
+    cl::ZeroOrMore);
+
+static cl::opt<int> SkipPercentile(
+    "irobf-hot-skip-percentile", cl::init(0), cl::NotHidden,
+    cl::desc("With -irobf-hotness=profile, functions and blocks within this "
+             "percentile of the profile counts (out of 1000000) are not "
+             "obfuscated at all. 0 disables it"),
+    cl::ZeroOrMore);
+
+static cl::opt<unsigned> StaticSkipDepth(
+    "irobf-static-skip-depth", cl::init(2), cl::NotHidden,
+    cl::desc("With -irobf-hotness=static, blocks at this loop depth or "
+             "deeper are not obfuscated at all. 0 disables it"),
+    cl::ZeroOrMore);
+
+static bool canSkip() {
+  return (ObfHotnessMode == HotnessMode::Profile && SkipPercentile > 0) ||
+         ObfHotnessMode == HotnessMode::Static;
+}
+
+// Without a profile: loop blocks and the targets of likely edges are hot,
+// deep loops and loop latches are skipped so back-edges stay direct
+static void estimateStatic(Function &F, LoopInfo &LI,
+                           ObfHotness &FunctionHotness,
+                           DenseMap<const BasicBlock *, ObfHotness> &Blocks) {
+  if (F.hasFnAttribute(Attribute::Cold)) {
+    return;
+  }
+  if (F.hasFnAttribute(Attribute::Hot) || F.hasMinSize()) {
+    FunctionHotness = ObfHotness::Hot;
+  }
+
+  for (const Loop *L : LI.getLoopsInPreorder()) {
+    SmallVector<BasicBlock *, 4> Latches;
+    L->getLoopLatches(Latches);
+    for (BasicBlock *Latch : Latches) {
+      Blocks[Latch] = ObfHotness::Skip;
+    }
+  }
+
+  BranchProbabilityInfo BPI(F, LI);
+  for (BasicBlock &BB : F) {
+    unsigned Depth = LI.getLoopDepth(&BB);
+    if (StaticSkipDepth > 0 && Depth >= StaticSkipDepth) {
+      Blocks[&BB] = ObfHotness::Skip;
+    } else if (Depth > 0) {
+      Blocks.try_emplace(&BB, ObfHotness::Hot);
+    }
+    if (succ_size(&BB) < 2) {
+      continue;
+    }
+    for (BasicBlock *Succ : successors(&BB)) {
+      if (BPI.isEdgeHot(&BB, Succ)) {
+        Blocks.try_emplace(Succ, ObfHotness::Hot);
+      }
+    }
+  }
+}
+
+HotnessInfo::HotnessInfo(Function &F, bool SkipOnly) {
+  if (F.isDeclaration() || (SkipOnly && !canSkip())) {
+    return;
+  }
+
+  DominatorTree DT(F);
+  LoopInfo      LI(DT);
+
+  if (ObfHotnessMode == HotnessMode::Static) {
+    estimateStatic(F, LI, FunctionHotness, Blocks);
+    return;
+  }
+
+  if (ObfHotnessMode == HotnessMode::Profile && F.hasProfileData()) {
+    ProfileSummaryInfo PSI(*F.getParent());
+    if (PSI.hasProfileSummary()) {
+      BranchProbabilityInfo BPI(F, LI);
+      BlockFrequencyInfo    BFI(F, BPI, LI);
+      auto within = [&](int Percentile, const BasicBlock *BB) {
+        return Percentile > 0 &&
+               PSI.isHotBlockNthPercentile(Percentile, BB, &BFI);
+      };
+
+      if (SkipPercentile > 0 &&
+          PSI.isFunctionHotInCallGraphNthPercentile(SkipPercentile, &F, BFI)) {
+        FunctionHotness = ObfHotness::Skip;
+        return;
+      }
+      if (PSI.isFunctionHotInCallGraphNthPercentile(HotPercentile, &F, BFI)) {
+        FunctionHotness = ObfHotness::Hot;
+      }
+      for (BasicBlock &BB : F) {
+        if (within(SkipPercentile, &BB)) {
+          Blocks[&BB] = ObfHotness::Skip;
+        } else if (within(HotPercentile, &BB)) {
+          Blocks[&BB] = ObfHotness::Hot;
+        }
+      }
+      return;
+    }
+  }
+
+  // Loop blocks never need to be skipped
+  if (SkipOnly) {
+    return;
+  }
+  for (BasicBlock &BB : F) {
+    if (LI.getLoopDepth(&BB) > 0) {
+      Blocks[&BB] = ObfHotness::Hot;
+    }
+  }
+}
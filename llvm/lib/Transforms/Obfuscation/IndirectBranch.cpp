@@ -1,18 +1,23 @@
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Obfuscation/IndirectBranch.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
-#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/Module.h"
 
 #include <random>
 
 #define DEBUG_TYPE "indbr"
 
+STATISTIC(KeyLoadsEliminated, "Key loads eliminated by hoisting");
+
 using namespace llvm;
 namespace {
 struct IndirectBranch : public FunctionPass {
@@ -23,16 +28,28 @@ struct IndirectBranch : public FunctionPass {
   std::map<BasicBlock *, unsigned> BBNumbering;
   std::vector<BasicBlock *> BBTargets;        //all conditional branch targets
   CryptoUtils RandomEngine;
+  bool Relative = false;
 
   IndirectBranch(unsigned pointerSize, ObfuscationOptions *argsOptions) : FunctionPass(ID) {
     this->pointerSize = pointerSize;
     this->ArgsOptions = argsOptions;
   }
 
+  // 相对偏移表按32位存放，密钥和解密运算也都用32位
+  IntegerType *getKeyType(LLVMContext &Ctx) const {
+    if (Relative || pointerSize != 8) {
+      return Type::getInt32Ty(Ctx);
+    }
+    return Type::getInt64Ty(Ctx);
+  }
+
   StringRef getPassName() const override { return {"IndirectBranch"}; }
 
-  void NumberBasicBlock(Function &F) {
+  void NumberBasicBlock(Function &F, const HotnessInfo &Hotness) {
     for (auto &BB : F) {
+      if (Hotness.skip(&BB)) {
+        continue;
+      }
       if (auto *BI = dyn_cast<BranchInst>(BB.getTerminator())) {
         if (BI->isConditional()) {
           unsigned N = BI->getNumSuccessors();
@@ -64,19 +81,14 @@ struct IndirectBranch : public FunctionPass {
       return GV;
 
     // encrypt branch targets
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (const auto BB:BBTargets) {
-      Constant *CE = ConstantExpr::getBitCast(BlockAddress::get(BB), PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, EncKey);
-      Elements.push_back(CE);
+      Targets.push_back(BlockAddress::get(BB));
+      Keys.push_back(EncKey);
     }
 
-    ArrayType *ATy =
-        ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-                                               CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -87,19 +99,14 @@ struct IndirectBranch : public FunctionPass {
       return GV;
 
     // encrypt branch targets
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (const auto BB:BBTargets) {
-      Constant *CE = ConstantExpr::getBitCast(BlockAddress::get(BB), PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, XorKey));
-      Elements.push_back(CE);
+      Targets.push_back(BlockAddress::get(BB));
+      Keys.push_back(ConstantExpr::getXor(AddKey, XorKey));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -110,24 +117,16 @@ struct IndirectBranch : public FunctionPass {
       return GV;
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
     // encrypt branch targets
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto BB:BBTargets) {
-      Constant *CE = ConstantExpr::getBitCast(BlockAddress::get(BB), PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, BBNumbering[BB], false))));
-      Elements.push_back(CE);
+      Targets.push_back(BlockAddress::get(BB));
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, BBNumbering[BB], false))));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -141,38 +140,30 @@ struct IndirectBranch : public FunctionPass {
       return std::make_pair(GVAdd, GVXor);
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
     // encrypt branch targets
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     std::vector<Constant *> XorKeys;
     for (auto BB:BBTargets) {
       uint64_t V = RandomEngine.get_uint64_t();
       Constant *XorKey = ConstantInt::get(intType, V, false);
-      Constant *CE = ConstantExpr::getBitCast(BlockAddress::get(BB), PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, BBNumbering[BB], false))));
+      Targets.push_back(BlockAddress::get(BB));
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, BBNumbering[BB], false))));
 
       XorKey = ConstantExpr::getNeg(XorKey);
       XorKey = ConstantExpr::getXor(XorKey, AddKey);
       XorKey = ConstantExpr::getNeg(XorKey);
       XorKeys.push_back(XorKey);
-      Elements.push_back(CE);
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GVAdd = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVNameAdd);
-    appendToCompilerUsed(*F.getParent(), {GVAdd});
+    GVAdd = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVNameAdd);
+    registerObfuscationData(GVAdd, &F);
 
     ArrayType *XTy = ArrayType::get(intType, XorKeys.size());
     Constant *CX = ConstantArray::get(XTy, XorKeys);
     GVXor = new GlobalVariable(*F.getParent(), XTy, false, GlobalValue::LinkageTypes::PrivateLinkage, CX, GVNameXor);
-    appendToCompilerUsed(*F.getParent(), {GVXor});
+    registerObfuscationData(GVXor, &F);
 
     return std::make_pair(GVAdd, GVXor);
   }
@@ -185,6 +176,8 @@ struct IndirectBranch : public FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *Fn.getParent(), &Fn);
 
     // hasLinkOnceLinkage 跳过不能混淆的函数类型（如声明、内联、虚函数等）
     if (Fn.empty() || Fn.hasLinkOnceLinkage() || Fn.getSection() == ".text.startup") {
@@ -199,21 +192,22 @@ struct IndirectBranch : public FunctionPass {
 
     // llvm cannot split critical edge from IndirectBrInst
     SplitAllCriticalEdges(Fn, CriticalEdgeSplittingOptions(nullptr, nullptr));
-    NumberBasicBlock(Fn);
+    // Branches in the hottest blocks stay direct
+    HotnessInfo Hotness(Fn, /*SkipOnly=*/true);
+    NumberBasicBlock(Fn, Hotness);
 
     if (BBNumbering.empty()) {
       return false;
     }
 
+    // 基本块地址总是可以用相对偏移表示
+    Relative = ArgsOptions->relativeTable();
+
     uint64_t V = RandomEngine.get_uint64_t();
     uint64_t XV = RandomEngine.get_uint64_t();
-    IntegerType* intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
     ConstantInt *EncKey = ConstantInt::get(intType, V, false);
     ConstantInt *EncKey1 = ConstantInt::get(intType, -V, false);
-    ConstantInt *Zero = ConstantInt::get(intType, 0);
 
     GlobalVariable *GXorKey = nullptr;
     GlobalVariable *DestBBs = nullptr;
@@ -225,7 +219,7 @@ struct IndirectBranch : public FunctionPass {
       ConstantInt *CXK = ConstantInt::get(intType, XV, false);
       GXorKey = new GlobalVariable(*Fn.getParent(), CXK->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
         CXK, Fn.getName() + "_IBrXorKey");
-      appendToCompilerUsed(*Fn.getParent(), {GXorKey});
+      registerObfuscationData(GXorKey, &Fn);
       if (opt.level() == 1) {
         DestBBs = getIndirectTargets1(Fn, EncKey1, CXK);
       } else {
@@ -237,9 +231,12 @@ struct IndirectBranch : public FunctionPass {
       XorKeys = snd;
     }
 
+    IndirectKeyDecoder Decoder(Fn, intType, EncKey, EncKey1, GXorKey, XorKeys,
+                               opt.level(), ArgsOptions->hoistKeys());
+
     for (auto &BB : Fn) {
       auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
-      if (BI && BI->isConditional()) {
+      if (BI && BI->isConditional() && !Hotness.skip(&BB)) {
         IRBuilder<> IRB(BI);
 
         Value *Cond = BI->getCondition();
@@ -250,44 +247,10 @@ struct IndirectBranch : public FunctionPass {
         FIdx = ConstantInt::get(intType, BBNumbering[BI->getSuccessor(1)]);
         Idx = IRB.CreateSelect(Cond, TIdx, FIdx);
 
-        Value *GEP = IRB.CreateGEP(
-          DestBBs->getValueType(), DestBBs,
-            {Zero, Idx});
-        Value *EncDestAddr = IRB.CreateLoad(
-            GEP->getType(),
-            GEP,
-            "EncDestAddr");
-        // -EncKey = X - FuncSecret
-        Value *DecKey = EncKey;
-
-        if (GXorKey) {
-          LoadInst *XorKey = IRB.CreateLoad(GXorKey->getValueType(), GXorKey);
-
-          if (opt.level() == 1) {
-            DecKey = IRB.CreateXor(EncKey1, XorKey);
-            DecKey = IRB.CreateNeg(DecKey);
-          } else if (opt.level() == 2) {
-            DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-            DecKey = IRB.CreateNeg(DecKey);
-          }
-        }
-
-        if (XorKeys) {
-          Value *XorKeysGEP = IRB.CreateGEP(XorKeys->getValueType(), XorKeys, {Zero, Idx});
-
-          Value *XorKey = IRB.CreateLoad(intType, XorKeysGEP);
-
-          XorKey = IRB.CreateNeg(XorKey);
-          XorKey = IRB.CreateXor(XorKey, EncKey1);
-          XorKey = IRB.CreateNeg(XorKey);
-
-          DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-          DecKey = IRB.CreateNeg(DecKey);
-        }
+        Value *DecKey = Decoder.get(IRB, Idx);
 
-        Value *DestAddr = IRB.CreateGEP(
-          Type::getInt8Ty(Ctx),
-            EncDestAddr, DecKey);
+        Value *DestAddr = loadTargetAddress(IRB, DestBBs, Idx, DecKey,
+                                            Relative, "EncDestAddr");
 
         IndirectBrInst *IBI = IndirectBrInst::Create(DestAddr, 2);
         IBI->addDestination(BI->getSuccessor(0));
@@ -296,6 +259,10 @@ struct IndirectBranch : public FunctionPass {
       }
     }
 
+    KeyLoadsEliminated += Decoder.loadsRequested() - Decoder.loadsEmitted();
+    LLVM_DEBUG(dbgs() << "indbr: " << Fn.getName() << " emitted "
+                      << Decoder.loadsEmitted() << " of "
+                      << Decoder.loadsRequested() << " key loads\n");
     return true;
   }
 
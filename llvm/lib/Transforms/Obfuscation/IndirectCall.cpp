@@ -1,17 +1,25 @@
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Obfuscation/IndirectCall.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
-#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
 
+#include <optional>
 #include <random>
 
 #define DEBUG_TYPE "icall"
 
+STATISTIC(KeyLoadsEliminated, "Key loads eliminated by hoisting");
+STATISTIC(AddrLoadsEliminated, "Callee address loads reused from a dominator");
+
 using namespace llvm;
 namespace {
 struct IndirectCall : public FunctionPass {
@@ -23,17 +31,29 @@ struct IndirectCall : public FunctionPass {
   std::vector<CallInst *> CallSites;
   std::vector<Function *> Callees;
   CryptoUtils RandomEngine;
+  bool Relative = false;
 
   IndirectCall(unsigned pointerSize, ObfuscationOptions *argsOptions) : FunctionPass(ID) {
     this->pointerSize = pointerSize;
     this->ArgsOptions = argsOptions;
   }
 
+  // 相对偏移表按32位存放，密钥和解密运算也都用32位
+  IntegerType *getKeyType(LLVMContext &Ctx) const {
+    if (Relative || pointerSize != 8) {
+      return Type::getInt32Ty(Ctx);
+    }
+    return Type::getInt64Ty(Ctx);
+  }
+
   StringRef getPassName() const override { return {"IndirectCall"}; }
 
   /// 查找 call function 指令，也就是函数调用指令，这个指令之后需要加密然后通过加密后的指令地址间接调用到目标函数
-  void NumberCallees(Function &F) {
+  void NumberCallees(Function &F, const HotnessInfo &Hotness) {
     for (auto &BB:F) {
+      if (Hotness.skip(&BB)) {
+        continue;
+      }
       for (auto &I:BB) {
         if (dyn_cast<CallInst>(&I)) {
           CallBase *CB = dyn_cast<CallBase>(&I);
@@ -69,20 +89,14 @@ struct IndirectCall : public FunctionPass {
       return GV;
 
     // callee's address
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto Callee:Callees) {
-      Constant *CE = ConstantExpr::getBitCast(
-          Callee, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, EncKey);
-      Elements.push_back(CE);
+      Targets.push_back(Callee);
+      Keys.push_back(EncKey);
     }
 
-    ArrayType *ATy =
-        ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-                                               CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -93,20 +107,14 @@ struct IndirectCall : public FunctionPass {
       return GV;
 
     // callee's address
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto Callee:Callees) {
-      Constant *CE = ConstantExpr::getBitCast(
-        Callee, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, XorKey));
-      Elements.push_back(CE);
+      Targets.push_back(Callee);
+      Keys.push_back(ConstantExpr::getXor(AddKey, XorKey));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -118,26 +126,17 @@ struct IndirectCall : public FunctionPass {
 
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
     // callee's address
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto Callee:Callees) {
-      Constant *CE = ConstantExpr::getBitCast(
-        Callee, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, CalleeNumbering[Callee], false))));
-      Elements.push_back(CE);
+      Targets.push_back(Callee);
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, CalleeNumbering[Callee], false))));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     
     return GV;
   }
@@ -152,40 +151,31 @@ struct IndirectCall : public FunctionPass {
 
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
     // callee's address
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     std::vector<Constant *> XorKeys;
     for (auto Callee:Callees) {
       uint64_t V = RandomEngine.get_uint64_t();
       Constant *XorKey = ConstantInt::get(intType, V, false);
 
-      Constant *CE = ConstantExpr::getBitCast(
-        Callee, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, CalleeNumbering[Callee], false))));
+      Targets.push_back(Callee);
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, CalleeNumbering[Callee], false))));
 
       XorKey = ConstantExpr::getNeg(XorKey);
       XorKey = ConstantExpr::getXor(XorKey, AddKey);
       XorKey = ConstantExpr::getNeg(XorKey);
       XorKeys.push_back(XorKey);
-      Elements.push_back(CE);
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GVAdd = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVNameAdd);
-    appendToCompilerUsed(*F.getParent(), {GVAdd});
+    GVAdd = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVNameAdd);
+    registerObfuscationData(GVAdd, &F);
 
     ArrayType *XTy = ArrayType::get(intType, XorKeys.size());
     Constant *CX = ConstantArray::get(XTy, XorKeys);
     GVXor = new GlobalVariable(*F.getParent(), XTy, false, GlobalValue::LinkageTypes::PrivateLinkage, CX, GVNameXor);
-    appendToCompilerUsed(*F.getParent(), {GVXor});
+    registerObfuscationData(GVXor, &F);
 
     return std::make_pair(GVAdd, GVXor);
   }
@@ -195,6 +185,8 @@ struct IndirectCall : public FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *Fn.getParent(), &Fn);
 
     LLVMContext &Ctx = Fn.getContext();
 
@@ -202,22 +194,24 @@ struct IndirectCall : public FunctionPass {
     Callees.clear();
     CallSites.clear();
 
-    NumberCallees(Fn);
+    // Call sites in the hottest blocks stay direct
+    HotnessInfo Hotness(Fn, /*SkipOnly=*/true);
+    NumberCallees(Fn, Hotness);
 
     if (Callees.empty()) {
       return false;
     }
 
+    Relative = ArgsOptions->relativeTable() &&
+               canUseRelativeTable(std::vector<Constant *>(Callees.begin(),
+                                                           Callees.end()));
+
     uint64_t V = RandomEngine.get_uint64_t();
     uint64_t XV = RandomEngine.get_uint64_t();
 
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
     ConstantInt *EncKey = ConstantInt::get(intType, V, false);
     ConstantInt *EncKey1 = ConstantInt::get(intType, -V, false);
-    ConstantInt *Zero = ConstantInt::get(intType, 0);
 
     GlobalVariable *GXorKey = nullptr;
     GlobalVariable *Targets = nullptr;
@@ -229,7 +223,7 @@ struct IndirectCall : public FunctionPass {
       ConstantInt *CXK = ConstantInt::get(intType, XV, false);
       GXorKey = new GlobalVariable(*Fn.getParent(), CXK->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
         CXK, Fn.getName() + "_ICallXorKey");
-      appendToCompilerUsed(*Fn.getParent(), {GXorKey});
+      registerObfuscationData(GXorKey, &Fn);
 
       if (opt.level() == 1) {
         Targets = getIndirectCallees1(Fn, EncKey1, CXK);
@@ -242,57 +236,55 @@ struct IndirectCall : public FunctionPass {
       XorKeys = snd;
     }
 
+    IndirectKeyDecoder Decoder(Fn, intType, EncKey, EncKey1, GXorKey, XorKeys,
+                               opt.level(), ArgsOptions->hoistKeys());
+    // Decoded callee addresses, reused by the call sites they dominate
+    std::optional<DominatorTree> DT;
+    DenseMap<Function *, SmallVector<Instruction *, 2>> DecodedCallees;
+    if (Decoder.isHoisted()) {
+      DT.emplace(Fn);
+    }
+
     for (auto CI : CallSites) {
 
       CallBase *CB = CI;
 
       Function *Callee = CB->getCalledFunction();
       FunctionType *FTy = Callee->getFunctionType();
-      IRBuilder<> IRB(CB);
 
-      Value *Idx = ConstantInt::get(intType, CalleeNumbering[CB->getCalledFunction()]);
-      Value *GEP = IRB.CreateGEP(
-          Targets->getValueType(), Targets,
-          {Zero, Idx});
-      Value *EncDestAddr = IRB.CreateLoad(
-          GEP->getType(), GEP,
-          CI->getName());
-
-      Value *DecKey = EncKey;
-
-      if (GXorKey) {
-        LoadInst *XorKey = IRB.CreateLoad(GXorKey->getValueType(), GXorKey);
-
-        if (opt.level() == 1) {
-          DecKey = IRB.CreateXor(EncKey1, XorKey);
-          DecKey = IRB.CreateNeg(DecKey);
-        } else if (opt.level() == 2) {
-          DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-          DecKey = IRB.CreateNeg(DecKey);
+      if (DT) {
+        auto &Decoded = DecodedCallees[Callee];
+        auto It = llvm::find_if(Decoded, [&](Instruction *Addr) {
+          return DT->dominates(Addr, CB);
+        });
+        if (It != Decoded.end()) {
+          CB->setCalledOperand(*It);
+          ++AddrLoadsEliminated;
+          continue;
         }
       }
 
-      if (XorKeys) {
-        Value *XorKeysGEP = IRB.CreateGEP(XorKeys->getValueType(), XorKeys, {Zero, Idx});
-        
-        Value *XorKey = IRB.CreateLoad(intType, XorKeysGEP);
+      IRBuilder<> IRB(CB);
 
-        XorKey = IRB.CreateNeg(XorKey);
-        XorKey = IRB.CreateXor(XorKey, EncKey1);
-        XorKey = IRB.CreateNeg(XorKey);
+      Value *Idx = ConstantInt::get(intType, CalleeNumbering[CB->getCalledFunction()]);
 
-        DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-        DecKey = IRB.CreateNeg(DecKey);
-      }
+      Value *DecKey = Decoder.get(IRB, Idx);
 
-      Value *DestAddr = IRB.CreateGEP(Type::getInt8Ty(Ctx),
-          EncDestAddr, DecKey);
+      Value *DestAddr = loadTargetAddress(IRB, Targets, Idx, DecKey,
+                                          Relative, CI->getName());
 
       Value *FnPtr = IRB.CreateBitCast(DestAddr, FTy->getPointerTo());
       FnPtr->setName("Call_" + Callee->getName());
       CB->setCalledOperand(FnPtr);
+      if (DT && isa<Instruction>(FnPtr)) {
+        DecodedCallees[Callee].push_back(cast<Instruction>(FnPtr));
+      }
     }
 
+    KeyLoadsEliminated += Decoder.loadsRequested() - Decoder.loadsEmitted();
+    LLVM_DEBUG(dbgs() << "icall: " << Fn.getName() << " emitted "
+                      << Decoder.loadsEmitted() << " of "
+                      << Decoder.loadsRequested() << " key loads\n");
     return true;
   }
 
@@ -1,17 +1,25 @@
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Obfuscation/IndirectGlobalVariable.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
-#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
 
+#include <optional>
 #include <random>
 
 #define DEBUG_TYPE "indgv"
 
+STATISTIC(KeyLoadsEliminated, "Key loads eliminated by hoisting");
+STATISTIC(AddrLoadsEliminated, "Global address loads reused from a dominator");
+
 using namespace llvm;
 namespace {
 struct IndirectGlobalVariable : public FunctionPass {
@@ -22,17 +30,29 @@ struct IndirectGlobalVariable : public FunctionPass {
   std::map<GlobalVariable *, unsigned> GVNumbering;
   std::vector<GlobalVariable *> GlobalVariables;
   CryptoUtils RandomEngine;
+  bool Relative = false;
 
   IndirectGlobalVariable(unsigned pointerSize, ObfuscationOptions *argsOptions) : FunctionPass(ID) {
     this->pointerSize = pointerSize;
     this->ArgsOptions = argsOptions;
   }
 
+  // 相对偏移表按32位存放，密钥和解密运算也都用32位
+  IntegerType *getKeyType(LLVMContext &Ctx) const {
+    if (Relative || pointerSize != 8) {
+      return Type::getInt32Ty(Ctx);
+    }
+    return Type::getInt64Ty(Ctx);
+  }
+
   StringRef getPassName() const override { return {"IndirectGlobalVariable"}; }
 
   /// 函数级别的全局变量地址引用，之后会将此函数用到的全局变量地址加密后再进行间接调用
-  void NumberGlobalVariable(Function &F) {
+  void NumberGlobalVariable(Function &F, const HotnessInfo &Hotness) {
     for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      if (Hotness.skip(I->getParent())) {
+        continue;
+      }
       for (User::op_iterator op = (*I).op_begin(); op != (*I).op_end(); ++op) {
         Value *val = *op;
         if (GlobalVariable *GV = dyn_cast<GlobalVariable>(val)) {
@@ -60,20 +80,14 @@ struct IndirectGlobalVariable : public FunctionPass {
     if (GV)
       return GV;
 
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto GVar:GlobalVariables) {
-      Constant *CE = ConstantExpr::getBitCast(
-          GVar, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, EncKey);
-      Elements.push_back(CE);
+      Targets.push_back(GVar);
+      Keys.push_back(EncKey);
     }
 
-    ArrayType *ATy =
-        ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-                            CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -83,20 +97,14 @@ struct IndirectGlobalVariable : public FunctionPass {
     if (GV)
       return GV;
 
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto GVar:GlobalVariables) {
-      Constant *CE = ConstantExpr::getBitCast(
-        GVar, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, XorKey));
-      Elements.push_back(CE);
+      Targets.push_back(GVar);
+      Keys.push_back(ConstantExpr::getXor(AddKey, XorKey));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -107,25 +115,16 @@ struct IndirectGlobalVariable : public FunctionPass {
       return GV;
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     for (auto GVar:GlobalVariables) {
-      Constant *CE = ConstantExpr::getBitCast(
-        GVar, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, GVNumbering[GVar], false))));
-      Elements.push_back(CE);
+      Targets.push_back(GVar);
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, GVNumbering[GVar], false))));
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GV = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVName);
-    appendToCompilerUsed(*F.getParent(), {GV});
+    GV = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVName);
+    registerObfuscationData(GV, &F);
     return GV;
   }
 
@@ -138,21 +137,16 @@ struct IndirectGlobalVariable : public FunctionPass {
       return std::make_pair(GVAdd, GVXor);
 
     auto& Ctx = F.getContext();
-    IntegerType *intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
-    std::vector<Constant *> Elements;
+    std::vector<Constant *> Targets, Keys;
     std::vector<Constant *> XorKeys;
     for (auto GVar:GlobalVariables) {
       uint64_t V = RandomEngine.get_uint64_t();
       Constant *XorKey = ConstantInt::get(intType, V, false);
 
-      Constant *CE = ConstantExpr::getBitCast(
-        GVar, PointerType::getUnqual(F.getContext()));
-      CE = ConstantExpr::getGetElementPtr(Type::getInt8Ty(F.getContext()), CE, ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, GVNumbering[GVar], false))));
-      Elements.push_back(CE);
+      Targets.push_back(GVar);
+      Keys.push_back(ConstantExpr::getXor(AddKey, ConstantExpr::getMul(XorKey, ConstantInt::get(intType, GVNumbering[GVar], false))));
 
       XorKey = ConstantExpr::getNeg(XorKey);
       XorKey = ConstantExpr::getXor(XorKey, AddKey);
@@ -160,17 +154,13 @@ struct IndirectGlobalVariable : public FunctionPass {
       XorKeys.push_back(XorKey);
     }
 
-    ArrayType *ATy =
-      ArrayType::get(PointerType::getUnqual(F.getContext()), Elements.size());
-    Constant *CA = ConstantArray::get(ATy, ArrayRef<Constant *>(Elements));
-    GVAdd = new GlobalVariable(*F.getParent(), ATy, false, GlobalValue::LinkageTypes::PrivateLinkage,
-      CA, GVNameAdd);
-    appendToCompilerUsed(*F.getParent(), {GVAdd});
+    GVAdd = createTargetTable(*F.getParent(), Targets, Keys, Relative, GVNameAdd);
+    registerObfuscationData(GVAdd, &F);
 
     ArrayType *XTy = ArrayType::get(intType, XorKeys.size());
     Constant *CX = ConstantArray::get(XTy, XorKeys);
     GVXor = new GlobalVariable(*F.getParent(), XTy, false, GlobalValue::LinkageTypes::PrivateLinkage, CX, GVNameXor);
-    appendToCompilerUsed(*F.getParent(), {GVXor});
+    registerObfuscationData(GVXor, &F);
     return std::make_pair(GVAdd, GVXor);
   }
 
@@ -179,6 +169,8 @@ struct IndirectGlobalVariable : public FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *Fn.getParent(), &Fn);
 
     LLVMContext &Ctx = Fn.getContext();
 
@@ -186,22 +178,24 @@ struct IndirectGlobalVariable : public FunctionPass {
     GlobalVariables.clear();
 
     LowerConstantExpr(Fn);
-    NumberGlobalVariable(Fn);
+    // Globals used in the hottest blocks are accessed directly
+    HotnessInfo Hotness(Fn, /*SkipOnly=*/true);
+    NumberGlobalVariable(Fn, Hotness);
 
     if (GlobalVariables.empty()) {
       return false;
     }
 
+    Relative = ArgsOptions->relativeTable() &&
+               canUseRelativeTable(std::vector<Constant *>(
+                   GlobalVariables.begin(), GlobalVariables.end()));
+
     uint64_t V = RandomEngine.get_uint64_t();
     uint64_t XV = RandomEngine.get_uint64_t();
-    IntegerType* intType = Type::getInt32Ty(Ctx);
-    if (pointerSize == 8) {
-      intType = Type::getInt64Ty(Ctx);
-    }
+    IntegerType *intType = getKeyType(Ctx);
 
     ConstantInt *EncKey = ConstantInt::get(intType, V, false);
     ConstantInt *EncKey1 = ConstantInt::get(intType, -V, false);
-    ConstantInt *Zero = ConstantInt::get(intType, 0);
 
     GlobalVariable *GXorKey = nullptr;
     GlobalVariable *GVars = nullptr;
@@ -213,7 +207,7 @@ struct IndirectGlobalVariable : public FunctionPass {
       ConstantInt *CXK = ConstantInt::get(intType, XV, false);
       GXorKey = new GlobalVariable(*Fn.getParent(), CXK->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
         CXK, Fn.getName() + "_IGVXorKey");
-      appendToCompilerUsed(*Fn.getParent(), {GXorKey});
+      registerObfuscationData(GXorKey, &Fn);
       if (opt.level() == 1) {
         GVars = getIndirectGlobalVariables1(Fn, EncKey1, CXK);
       } else {
@@ -225,12 +219,38 @@ struct IndirectGlobalVariable : public FunctionPass {
       XorKeys = snd;
     }
 
+    IndirectKeyDecoder Decoder(Fn, intType, EncKey, EncKey1, GXorKey, XorKeys,
+                               opt.level(), ArgsOptions->hoistKeys());
+    // Decoded global addresses, reused by the uses they dominate
+    std::optional<DominatorTree> DT;
+    DenseMap<GlobalVariable *, SmallVector<Instruction *, 2>> DecodedGVs;
+    if (Decoder.isHoisted()) {
+      DT.emplace(Fn);
+    }
+    auto findDecoded = [&](GlobalVariable *GV, Instruction *IP) -> Value * {
+      if (!DT) {
+        return nullptr;
+      }
+      for (Instruction *Addr : DecodedGVs[GV]) {
+        if (DT->dominates(Addr, IP)) {
+          ++AddrLoadsEliminated;
+          return Addr;
+        }
+      }
+      return nullptr;
+    };
+    auto addDecoded = [&](GlobalVariable *GV, Value *Addr) {
+      if (DT && isa<Instruction>(Addr)) {
+        DecodedGVs[GV].push_back(cast<Instruction>(Addr));
+      }
+    };
+
     for (inst_iterator I = inst_begin(Fn), E = inst_end(Fn); I != E; ++I) {
       Instruction *Inst = &*I;
       if (isa<LandingPadInst>(Inst) || isa<CleanupPadInst>(Inst) ||
           isa<CatchPadInst>(Inst) || isa<CatchReturnInst>(Inst) ||
           isa<CatchSwitchInst>(Inst) || isa<ResumeInst>(Inst) || 
-          isa<CallInst>(Inst)) {
+          isa<CallInst>(Inst) || Hotness.skip(Inst->getParent())) {
         continue;
       }
       if (PHINode *PHI = dyn_cast<PHINode>(Inst)) {
@@ -241,51 +261,26 @@ struct IndirectGlobalVariable : public FunctionPass {
               continue;
             }
 
+            if (Hotness.skip(PHI->getIncomingBlock(i))) {
+              continue;
+            }
             Instruction *IP = PHI->getIncomingBlock(i)->getTerminator();
+            if (Value *Addr = findDecoded(GV, IP)) {
+              PHI->setIncomingValue(i, Addr);
+              continue;
+            }
             IRBuilder<> IRB(IP);
 
             Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
-            Value *GEP = IRB.CreateGEP(
-                GVars->getValueType(),
-                GVars,
-                {Zero, Idx});
-            LoadInst *EncGVAddr = IRB.CreateLoad(
-                GEP->getType(), GEP,
-                GV->getName());
-
-            Value *DecKey = EncKey;
-            if (GXorKey) {
-              LoadInst *XorKey = IRB.CreateLoad(GXorKey->getValueType(), GXorKey);
-
-              if (opt.level() == 1) {
-                DecKey = IRB.CreateXor(EncKey1, XorKey);
-                DecKey = IRB.CreateNeg(DecKey);
-              } else if (opt.level() == 2) {
-                DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-                DecKey = IRB.CreateNeg(DecKey);
-              }
-            }
-
-            if (XorKeys) {
-              Value *XorKeysGEP = IRB.CreateGEP(XorKeys->getValueType(), XorKeys, {Zero, Idx});
-
-              Value *XorKey = IRB.CreateLoad(intType, XorKeysGEP);
 
-              XorKey = IRB.CreateNeg(XorKey);
-              XorKey = IRB.CreateXor(XorKey, EncKey1);
-              XorKey = IRB.CreateNeg(XorKey);
+            Value *DecKey = Decoder.get(IRB, Idx);
 
-              DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-              DecKey = IRB.CreateNeg(DecKey);
-            }
-
-            Value *GVAddr = IRB.CreateGEP(
-              Type::getInt8Ty(Ctx),
-                EncGVAddr,
-              DecKey);
+            Value *GVAddr = loadTargetAddress(IRB, GVars, Idx, DecKey,
+                                              Relative, GV->getName());
             GVAddr = IRB.CreateBitCast(GVAddr, GV->getType());
             GVAddr->setName("IndGV0_");
             PHI->setIncomingValue(i, GVAddr);
+            addDecoded(GV, GVAddr);
           }
         }
       } else {
@@ -295,57 +290,33 @@ struct IndirectGlobalVariable : public FunctionPass {
               continue;
             }
 
-            IRBuilder<> IRB(Inst);
-            Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
-            Value *GEP = IRB.CreateGEP(
-                GVars->getValueType(),
-                GVars,
-                {Zero, Idx});
-            LoadInst *EncGVAddr = IRB.CreateLoad(
-                GEP->getType(),
-                GEP,
-                GV->getName());
-
-            Value *DecKey = EncKey;
-            if (GXorKey) {
-              LoadInst *XorKey = IRB.CreateLoad(GXorKey->getValueType(), GXorKey);
-
-              if (opt.level() == 1) {
-                DecKey = IRB.CreateXor(EncKey1, XorKey);
-                DecKey = IRB.CreateNeg(DecKey);
-              } else if (opt.level() == 2) {
-                DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-                DecKey = IRB.CreateNeg(DecKey);
-              }
+            if (Value *Addr = findDecoded(GV, Inst)) {
+              Inst->replaceUsesOfWith(GV, Addr);
+              continue;
             }
 
-            if (XorKeys) {
-              Value *XorKeysGEP = IRB.CreateGEP(XorKeys->getValueType(), XorKeys, {Zero, Idx});
-
-              Value *XorKey = IRB.CreateLoad(intType, XorKeysGEP);
-
-              XorKey = IRB.CreateNeg(XorKey);
-              XorKey = IRB.CreateXor(XorKey, EncKey1);
-              XorKey = IRB.CreateNeg(XorKey);
+            IRBuilder<> IRB(Inst);
+            Value *Idx = ConstantInt::get(intType, GVNumbering[GV]);
 
-              DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
-              DecKey = IRB.CreateNeg(DecKey);
-            }
+            Value *DecKey = Decoder.get(IRB, Idx);
 
-            Value *GVAddr = IRB.CreateGEP(
-              Type::getInt8Ty(Ctx),
-                EncGVAddr,
-                DecKey);
+            Value *GVAddr = loadTargetAddress(IRB, GVars, Idx, DecKey,
+                                              Relative, GV->getName());
             GVAddr = IRB.CreateBitCast(GVAddr, GV->getType());
             GVAddr->setName("IndGV1_");
             Inst->replaceUsesOfWith(GV, GVAddr);
+            addDecoded(GV, GVAddr);
           }
         }
       }
     }
 
-      return true;
-    }
+    KeyLoadsEliminated += Decoder.loadsRequested() - Decoder.loadsEmitted();
+    LLVM_DEBUG(dbgs() << "indgv: " << Fn.getName() << " emitted "
+                      << Decoder.loadsEmitted() << " of "
+                      << Decoder.loadsRequested() << " key loads\n");
+    return true;
+  }
 
   };
 } // namespace llvm
@@ -23,12 +23,17 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/ProfDataUtils.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <algorithm>
 #include <cassert>
@@ -41,6 +46,23 @@ using namespace llvm;
 
 #define DEBUG_TYPE "lower-switch"
 
+static cl::opt<bool> UseProfileWeights(
+    "lower-switch-use-prof", cl::init(true), cl::Hidden,
+    cl::desc("Build a weight-balanced compare tree from !prof branch weights"));
+
+static cl::opt<unsigned> MinJumpTableCases(
+    "lower-switch-min-jump-table-cases", cl::init(4), cl::Hidden,
+    cl::desc("Minimum number of cases for a switch to keep its jump table"));
+
+static cl::opt<unsigned> JumpTableDensity(
+    "lower-switch-jump-table-density", cl::init(40), cl::Hidden,
+    cl::desc("Minimum density (in percent) for a switch to keep its jump "
+             "table"));
+
+static cl::opt<unsigned> MaxJumpTableRange(
+    "lower-switch-max-jump-table-range", cl::init(4096), cl::Hidden,
+    cl::desc("Maximum case value range of a switch that keeps its jump table"));
+
 namespace {
 
   struct IntRange {
@@ -71,7 +93,8 @@ namespace {
     // Pass identification, replacement for typeid
     static char ID;
 
-    LowerSwitch() : FunctionPass(ID) {
+    LowerSwitch(bool KeepJumpTables = false)
+        : FunctionPass(ID), KeepJumpTables(KeepJumpTables) {
       //initializeLowerSwitchPass(*PassRegistry::getPassRegistry());
     }
 
@@ -81,15 +104,22 @@ namespace {
       ConstantInt* Low;
       ConstantInt* High;
       BasicBlock* BB;
+      uint64_t Weight;
+      // Share of the default weight that leaves the tree at this cluster
+      uint64_t DefaultWeight = 0;
 
-      CaseRange(ConstantInt *low, ConstantInt *high, BasicBlock *bb)
-          : Low(low), High(high), BB(bb) {}
+      CaseRange(ConstantInt *low, ConstantInt *high, BasicBlock *bb,
+                uint64_t weight = 0)
+          : Low(low), High(high), BB(bb), Weight(weight) {}
     };
 
     using CaseVector = std::vector<CaseRange>;
     using CaseItr = std::vector<CaseRange>::iterator;
 
   private:
+    // Leave switches that will become jump tables untouched
+    bool KeepJumpTables;
+
     void processSwitchInst(SwitchInst *SI, SmallPtrSetImpl<BasicBlock*> &DeleteList);
 
     BasicBlock *switchConvert(CaseItr Begin, CaseItr End,
@@ -124,8 +154,30 @@ char LowerSwitch::ID = 0;
 //                "Lower SwitchInst's to branches", false, false)
 
 // createLowerSwitchPass - Interface to this file...
-FunctionPass *llvm::createLegacyLowerSwitchPass() {
-  return new LowerSwitch();
+FunctionPass *llvm::createLegacyLowerSwitchPass(bool KeepJumpTables) {
+  return new LowerSwitch(KeepJumpTables);
+}
+
+/// Mirror the backend's jump table heuristic: enough cases, spread over a
+/// small enough range and dense enough to be worth a table.
+bool llvm::isJumpTableSwitch(const SwitchInst *SI) {
+  unsigned NumCases = SI->getNumCases();
+  if (NumCases < MinJumpTableCases ||
+      SI->getCondition()->getType()->getIntegerBitWidth() > 64)
+    return false;
+
+  int64_t Low = std::numeric_limits<int64_t>::max();
+  int64_t High = std::numeric_limits<int64_t>::min();
+  for (auto Case : SI->cases()) {
+    int64_t V = Case.getCaseValue()->getSExtValue();
+    Low = std::min(Low, V);
+    High = std::max(High, V);
+  }
+
+  uint64_t Range = (uint64_t)High - (uint64_t)Low + 1;
+  if (Range == 0 || Range > MaxJumpTableRange)
+    return false;
+  return (uint64_t)NumCases * 100 >= Range * JumpTableDensity;
 }
 
 bool LowerSwitch::runOnFunction(Function &F) {
@@ -141,6 +193,8 @@ bool LowerSwitch::runOnFunction(Function &F) {
       continue;
 
     if (SwitchInst *SI = dyn_cast<SwitchInst>(Cur->getTerminator())) {
+      if (KeepJumpTables && isJumpTableSwitch(SI))
+        continue;
       Changed = true;
       processSwitchInst(SI, DeleteList);
     }
@@ -239,7 +293,28 @@ LowerSwitch::switchConvert(CaseItr Begin, CaseItr End, ConstantInt *LowerBound,
     return newLeafBlock(*Begin, Val, OrigBlock, Default);
   }
 
+  // With profile weights, split where both halves are equally likely so hot
+  // cases end up close to the root. Otherwise balance by case count.
   unsigned Mid = Size / 2;
+  uint64_t TotalWeight = 0;
+  for (CaseItr I = Begin; I != End; ++I)
+    TotalWeight += I->Weight + I->DefaultWeight;
+  uint64_t LeftWeight = 0;
+  if (TotalWeight) {
+    uint64_t BestDiff = std::numeric_limits<uint64_t>::max();
+    uint64_t Prefix = 0;
+    for (unsigned K = 1; K < Size; ++K) {
+      Prefix += (Begin + K - 1)->Weight + (Begin + K - 1)->DefaultWeight;
+      uint64_t Suffix = TotalWeight - Prefix;
+      uint64_t Diff = Prefix > Suffix ? Prefix - Suffix : Suffix - Prefix;
+      if (Diff < BestDiff) {
+        BestDiff = Diff;
+        Mid = K;
+        LeftWeight = Prefix;
+      }
+    }
+  }
+
   std::vector<CaseRange> LHS(Begin, Begin + Mid);
   LLVM_DEBUG(dbgs() << "LHS: " << LHS << "\n");
   std::vector<CaseRange> RHS(Begin + Mid, End);
@@ -296,7 +371,9 @@ LowerSwitch::switchConvert(CaseItr Begin, CaseItr End, ConstantInt *LowerBound,
   F->insert(++OrigBlock->getIterator(), NewNode);
   Comp->insertInto(NewNode, NewNode->end());
 
-  BranchInst::Create(LBranch, RBranch, Comp, NewNode);
+  BranchInst *Br = BranchInst::Create(LBranch, RBranch, Comp, NewNode);
+  if (TotalWeight)
+    setScaledBranchWeights(Br, {LeftWeight, TotalWeight - LeftWeight});
   return NewNode;
 }
 
@@ -341,7 +418,9 @@ BasicBlock* LowerSwitch::newLeafBlock(CaseRange& Leaf, Value* Val,
 
   // Make the conditional branch...
   BasicBlock* Succ = Leaf.BB;
-  BranchInst::Create(Succ, Default, Comp, NewLeaf);
+  BranchInst *Br = BranchInst::Create(Succ, Default, Comp, NewLeaf);
+  if (Leaf.Weight || Leaf.DefaultWeight)
+    setScaledBranchWeights(Br, {Leaf.Weight, Leaf.DefaultWeight});
 
   // If there were any PHI nodes in this successor, rewrite one entry
   // from OrigBlock to come from NewLeaf.
@@ -362,14 +441,31 @@ BasicBlock* LowerSwitch::newLeafBlock(CaseRange& Leaf, Value* Val,
   return NewLeaf;
 }
 
+/// Values that reach the default destination can leave the tree at any leaf.
+/// Without knowing which, give every cluster an equal share, rounded up so a
+/// small nonzero default weight is not lost.
+static void spreadDefaultWeight(LowerSwitch::CaseVector &Cases,
+                                uint64_t DefaultWeight) {
+  uint64_t Share = Cases.empty() ? 0 : divideCeil(DefaultWeight, Cases.size());
+  for (LowerSwitch::CaseRange &C : Cases)
+    C.DefaultWeight = Share;
+}
+
 /// Transform simple list of Cases into list of CaseRange's.
 unsigned LowerSwitch::Clusterify(CaseVector& Cases, SwitchInst *SI) {
   unsigned numCmps = 0;
 
+  // Weights[0] belongs to the default destination, see spreadDefaultWeight
+  SmallVector<uint32_t, 16> Weights;
+  if (!UseProfileWeights || !extractBranchWeights(*SI, Weights) ||
+      Weights.size() != SI->getNumCases() + 1)
+    Weights.clear();
+
   // Start with "simple" cases
   for (auto Case : SI->cases())
-    Cases.push_back(CaseRange(Case.getCaseValue(), Case.getCaseValue(),
-                              Case.getCaseSuccessor()));
+    Cases.push_back(CaseRange(
+        Case.getCaseValue(), Case.getCaseValue(), Case.getCaseSuccessor(),
+        Weights.empty() ? 0 : Weights[Case.getCaseIndex() + 1]));
 
   llvm::sort(Cases.begin(), Cases.end(), CaseCmp());
 
@@ -387,13 +483,15 @@ unsigned LowerSwitch::Clusterify(CaseVector& Cases, SwitchInst *SI) {
       assert(nextValue > currentValue && "Cases should be strictly ascending");
       if ((nextValue == currentValue + 1) && (currentBB == nextBB)) {
         I->High = J->High;
-        // FIXME: Combine branch weights.
+        I->Weight += J->Weight;
       } else if (++I != J) {
         *I = *J;
       }
     }
     Cases.erase(std::next(I), Cases.end());
   }
+  if (!Weights.empty())
+    spreadDefaultWeight(Cases, Weights[0]);
 
   for (CaseItr I=Cases.begin(), E=Cases.end(); I!=E; ++I, ++numCmps) {
     if (I->Low != I->High)
@@ -502,6 +600,10 @@ void LowerSwitch::processSwitchInst(SwitchInst *SI,
     // cases.
     assert(MaxPop > 0 && PopSucc);
     Default = PopSucc;
+    uint64_t PopWeight = 0;
+    for (const CaseRange &C : Cases)
+      if (C.BB == PopSucc)
+        PopWeight += C.Weight;
     Cases.erase(
         llvm::remove_if(
             Cases, [PopSucc](const CaseRange &R) { return R.BB == PopSucc; }),
@@ -517,6 +619,10 @@ void LowerSwitch::processSwitchInst(SwitchInst *SI,
         PopSucc->removePredecessor(OrigBlock);
       return;
     }
+
+    // The old default is unreachable, the cases of the new one are now
+    // reached through it
+    spreadDefaultWeight(Cases, PopWeight);
   }
 
   unsigned NrOfDefaults = (SI->getDefaultDest() == Default) ? 1 : 0;
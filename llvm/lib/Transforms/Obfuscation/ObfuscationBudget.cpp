@@ -0,0 +1,321 @@
+#include "llvm/Transforms/Obfuscation/ObfuscationBudget.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Transforms/Obfuscation/Utils.h"
+
+#define DEBUG_TYPE "ir-obfuscation"
+
+using namespace llvm;
+
+using Slot = ObfuscationOptions::OptSlot;
+
+static double costValue(InstructionCost C) {
+  return C.isValid() ? (double)*C.getValue() : 1.0;
+}
+
+static bool isStringGlobal(const GlobalVariable *GV) {
+  if (!GV->isConstant() || !GV->hasInitializer()) {
+    return false;
+  }
+  auto *CDS = dyn_cast<ConstantDataSequential>(GV->getInitializer());
+  return CDS && CDS->isString();
+}
+
+ObfuscationCostModel::ObfuscationCostModel(Function &F,
+                                           const TargetTransformInfo &TTI) {
+  constexpr auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  LLVMContext &Ctx = F.getContext();
+  Type *IntTy = Type::getInt64Ty(Ctx);
+  Alu = costValue(TTI.getArithmeticInstrCost(Instruction::Add, IntTy,
+                                             CostKind));
+  Load = costValue(TTI.getMemoryOpCost(Instruction::Load, IntTy, Align(8), 0,
+                                       CostKind));
+  Branch = costValue(TTI.getCFInstrCost(Instruction::Br, CostKind));
+  IndirectBranch =
+      costValue(TTI.getCFInstrCost(Instruction::IndirectBr, CostKind));
+  // Call overhead is not modelled by TTI, count it as a branch and a few
+  // instructions of prologue and epilogue
+  Call = Branch + 4 * Alu;
+
+  // Static estimates unless the function carries profile weights
+  DominatorTree         DT(F);
+  LoopInfo              LI(DT);
+  BranchProbabilityInfo BPI(F, LI);
+  BlockFrequencyInfo    BFI(F, BPI, LI);
+  double EntryFreq = (double)BFI.getEntryFreq().getFrequency();
+  if (EntryFreq == 0) {
+    EntryFreq = 1;
+  }
+
+  auto site = [&](Slot S, double W) {
+    SlotSites[S].Count += 1;
+    SlotSites[S].Freq += W;
+  };
+
+  for (BasicBlock &BB : F) {
+    double W = (double)BFI.getBlockFreq(&BB).getFrequency() / EntryFreq;
+    if (!BB.isEHPad()) {
+      site(ObfuscationOptions::BcfSlot, W);
+    }
+    site(ObfuscationOptions::FlaSlot, W);
+
+    for (Instruction &I : BB) {
+      Base.Size += 1;
+      Base.Cycles += W * costValue(TTI.getInstructionCost(&I, CostKind));
+
+      if (isa<IntrinsicInst>(I) || isa<AllocaInst>(I) || I.isEHPad()) {
+        continue;
+      }
+      if (auto *BI = dyn_cast<BranchInst>(&I)) {
+        if (BI->isConditional()) {
+          site(ObfuscationOptions::IndBrSlot, W);
+        }
+        continue;
+      }
+      auto *CI = dyn_cast<CallInst>(&I);
+      if (CI && CI->getCalledFunction() &&
+          !CI->getCalledFunction()->isIntrinsic()) {
+        site(ObfuscationOptions::ICallSlot, W);
+      }
+      if (isa<BinaryOperator>(I) && I.getType()->isIntOrIntVectorTy()) {
+        switch (I.getOpcode()) {
+        case Instruction::Add:
+        case Instruction::Sub:
+        case Instruction::And:
+        case Instruction::Or:
+        case Instruction::Xor:
+          site(ObfuscationOptions::SubSlot, W);
+          break;
+        default:
+          break;
+        }
+      }
+      for (Value *Op : I.operands()) {
+        if (isa<ConstantInt>(Op) && !isa<SwitchInst>(I)) {
+          site(ObfuscationOptions::CieSlot, W);
+        } else if (isa<ConstantFP>(Op)) {
+          site(ObfuscationOptions::CfeSlot, W);
+        } else if (auto *GV = dyn_cast<GlobalVariable>(Op)) {
+          if (!CI && !GV->isThreadLocal()) {
+            site(ObfuscationOptions::IndGvSlot, W);
+          }
+          if (isStringGlobal(GV)) {
+            site(ObfuscationOptions::CseSlot, W);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Instructions a transform adds per site at a given level, split by kind.
+// The numbers follow the code the passes emit: the table load and key
+// decoding of the indirect passes grow with the level, substitution nests
+// one rewrite per extra depth.
+ObfuscationCostModel::Cost ObfuscationCostModel::overhead(unsigned S,
+                                                          uint32_t L) const {
+  double NAlu = 0, NLoad = 0, NCtrl = 0, NSize = 0;
+  double Density = 1;
+  const double Level = std::min<uint32_t>(L, 3);
+  const double BlockSize =
+      SlotSites[ObfuscationOptions::FlaSlot].Count
+          ? Base.Size / SlotSites[ObfuscationOptions::FlaSlot].Count
+          : 0;
+
+  switch (S) {
+  case ObfuscationOptions::IndBrSlot:
+    NAlu = 2 + Level;
+    NLoad = 1 + (L > 0);
+    NCtrl = IndirectBranch - Branch;
+    break;
+  case ObfuscationOptions::ICallSlot:
+    NAlu = 1 + Level;
+    NLoad = 1 + (L > 0);
+    NCtrl = IndirectBranch - Branch;
+    break;
+  case ObfuscationOptions::IndGvSlot:
+    NAlu = 1 + Level;
+    NLoad = 1 + (L > 0);
+    break;
+  case ObfuscationOptions::CieSlot:
+    NAlu = 2 + 2 * Level;
+    NLoad = 1;
+    break;
+  case ObfuscationOptions::CfeSlot:
+    NAlu = 3 + 2 * Level;
+    NLoad = 1;
+    break;
+  case ObfuscationOptions::SubSlot:
+    NAlu = 3 * (1 + (double)L);
+    break;
+  case ObfuscationOptions::BcfSlot:
+    // Level is the percentage of blocks, each gets two opaque predicates
+    // and a never executed copy of its body
+    Density = std::min<uint32_t>(L, 100) / 100.0;
+    NAlu = 4;
+    NLoad = 2;
+    NCtrl = 2 * Branch;
+    NSize = BlockSize;
+    break;
+  case ObfuscationOptions::FlaSlot:
+    // Every block goes through the dispatcher: store and reload the state
+    // and a switch lowered to a jump table
+    NAlu = 1;
+    NLoad = 2;
+    NCtrl = IndirectBranch;
+    break;
+  case ObfuscationOptions::CseSlot:
+    NAlu = 2;
+    NLoad = 1;
+    NCtrl = Call + Branch;
+    break;
+  default:
+    return {};
+  }
+
+  const Sites &Site = SlotSites[S];
+  Cost Result;
+  Result.Size = Density * Site.Count * (NAlu + NLoad + (NCtrl > 0) + NSize);
+  Result.Cycles =
+      Density * Site.Freq * (NAlu * Alu + NLoad * Load + std::max(NCtrl, 0.0));
+  return Result;
+}
+
+// One step down: lower the level, or turn the transform off at the bottom
+static void downgrade(unsigned S, ObfuscationOptions::FunctionOpts &Opts) {
+  uint32_t &L = Opts.Level[S];
+  switch (S) {
+  case ObfuscationOptions::BcfSlot:
+    L = L / 2;
+    Opts.Enabled[S] = L >= 5;
+    break;
+  case ObfuscationOptions::FlaSlot:
+  case ObfuscationOptions::CseSlot:
+    Opts.Enabled[S] = false;
+    break;
+  case ObfuscationOptions::SubSlot:
+    if (L == 0) {
+      Opts.Enabled[S] = false;
+    } else {
+      --L;
+    }
+    break;
+  default:
+    if (L == 0) {
+      Opts.Enabled[S] = false;
+    } else {
+      L = std::min<uint32_t>(L, 3) - 1;
+    }
+    break;
+  }
+}
+
+bool llvm::fitObfuscationBudget(Function &F, const TargetTransformInfo &TTI,
+                                const ObfuscationBudget &Budget,
+                                ArrayRef<std::shared_ptr<ObfOpt>> AllOpt,
+                                ObfuscationOptions::FunctionOpts &Opts) {
+  if (!Budget.enabled()) {
+    return false;
+  }
+  ObfuscationCostModel Model(F, TTI);
+  const auto &Base = Model.base();
+  if (Base.Size == 0) {
+    return false;
+  }
+
+  const ObfuscationOptions::FunctionOpts Requested = Opts;
+  auto total = [&] {
+    ObfuscationCostModel::Cost Sum;
+    for (unsigned S = 0; S < ObfuscationOptions::NumOpts; ++S) {
+      if (Opts.Enabled[S]) {
+        auto C = Model.overhead(S, Opts.Level[S]);
+        Sum.Size += C.Size;
+        Sum.Cycles += C.Cycles;
+      }
+    }
+    return Sum;
+  };
+  auto sizePercent = [&](const ObfuscationCostModel::Cost &C) {
+    return 100.0 * (Base.Size + C.Size) / Base.Size;
+  };
+  auto cyclePercent = [&](const ObfuscationCostModel::Cost &C) {
+    return Base.Cycles ? 100.0 * C.Cycles / Base.Cycles : 0.0;
+  };
+
+  bool Changed = false;
+  auto Sum = total();
+  while (true) {
+    bool OverSize = Budget.SizePercent && sizePercent(Sum) > Budget.SizePercent;
+    bool OverCycles =
+        Budget.CyclePercent && cyclePercent(Sum) > Budget.CyclePercent;
+    if (!OverSize && !OverCycles) {
+      break;
+    }
+
+    // Step down the transform that costs the most in the exceeded metric
+    int Worst = -1;
+    double WorstCost = 0;
+    for (unsigned S = 0; S < ObfuscationOptions::NumOpts; ++S) {
+      if (!Opts.Enabled[S]) {
+        continue;
+      }
+      auto C = Model.overhead(S, Opts.Level[S]);
+      double Weight = (OverCycles ? C.Cycles / std::max(Base.Cycles, 1.0) : 0) +
+                      (OverSize ? C.Size / Base.Size : 0);
+      if (Worst < 0 || Weight > WorstCost) {
+        Worst = S;
+        WorstCost = Weight;
+      }
+    }
+    if (Worst < 0) {
+      break;
+    }
+    downgrade(Worst, Opts);
+    Changed = true;
+    Sum = total();
+  }
+
+  if (!Changed) {
+    return false;
+  }
+
+  std::string Choice;
+  raw_string_ostream OS(Choice);
+  for (unsigned S = 0; S < ObfuscationOptions::NumOpts; ++S) {
+    if (Requested.Enabled[S] == Opts.Enabled[S] &&
+        Requested.Level[S] == Opts.Level[S]) {
+      continue;
+    }
+    OS << (Choice.empty() ? "" : ", ") << AllOpt[S]->attributeName();
+    if (Opts.Enabled[S]) {
+      OS << " level " << Requested.Level[S] << "->" << Opts.Level[S];
+    } else {
+      OS << " off";
+    }
+  }
+  OS.flush();
+  LLVM_DEBUG(dbgs() << "irobf-budget: " << F.getName() << ": " << Choice
+                    << format(" (estimated size %.0f%%, cycles +%.0f%%)\n",
+                              sizePercent(Sum), cyclePercent(Sum)));
+
+  if (obfuscationRemarksEnabled(F)) {
+    using NV = DiagnosticInfoOptimizationBase::Argument;
+    OptimizationRemark Remark(DEBUG_TYPE, "ObfuscationBudget", &F);
+    Remark << "obfuscation budget: " << NV("Choice", Choice)
+           << ", estimated size "
+           << NV("EstimatedSizePercent", (unsigned)sizePercent(Sum))
+           << "%, cycles +"
+           << NV("EstimatedCyclePercent", (unsigned)cyclePercent(Sum)) << "%";
+    F.getContext().diagnose(Remark);
+  }
+  return true;
+}
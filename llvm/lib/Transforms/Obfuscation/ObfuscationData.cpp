@@ -0,0 +1,170 @@
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#define DEBUG_TYPE "ir-obfuscation"
+
+using namespace llvm;
+
+STATISTIC(PackedGlobals, "Obfuscation globals packed into data blocks");
+STATISTIC(DedupedGlobals, "Identical obfuscation globals merged");
+STATISTIC(AssociatedGlobals, "Obfuscation globals associated with their function");
+
+static const char *OwnerMDName = "irobf.owner";
+static constexpr unsigned CacheLineSize = 64;
+
+void llvm::registerObfuscationData(GlobalVariable *GV, Function *Owner) {
+  LLVMContext &Ctx = GV->getContext();
+  GV->setMetadata(OwnerMDName,
+                  MDNode::get(Ctx, ValueAsMetadata::get(Owner)));
+}
+
+Function *llvm::getObfuscationDataOwner(const GlobalVariable *GV) {
+  MDNode *MD = GV->getMetadata(OwnerMDName);
+  if (!MD || MD->getNumOperands() == 0)
+    return nullptr;
+  auto *VAM = dyn_cast_or_null<ValueAsMetadata>(MD->getOperand(0));
+  return VAM ? dyn_cast<Function>(VAM->getValue()) : nullptr;
+}
+
+void llvm::finalizeObfuscationData(Module &M) {
+  // One update of llvm.compiler.used for the whole module, appending one
+  // global at a time rebuilds the array every time
+  SmallVector<GlobalValue *, 64> Pinned;
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.getMetadata(OwnerMDName)) {
+      Pinned.push_back(&GV);
+      GV.setMetadata(OwnerMDName, nullptr);
+    }
+  }
+  if (!Pinned.empty())
+    appendToCompilerUsed(M, Pinned);
+}
+
+// Lay the globals out back to back in one block, each at its own alignment,
+// and redirect every use to its field
+static GlobalVariable *createDataBlock(Module &M,
+                                       ArrayRef<GlobalVariable *> GVs,
+                                       bool IsConstant, const Twine &Name) {
+  const DataLayout &DL = M.getDataLayout();
+  LLVMContext &Ctx = M.getContext();
+  Type *I8Ty = Type::getInt8Ty(Ctx);
+
+  SmallVector<Type *, 32> FieldTys;
+  SmallVector<Constant *, 32> Fields;
+  SmallVector<unsigned, 32> FieldIndex;
+  uint64_t Offset = 0;
+  for (GlobalVariable *GV : GVs) {
+    Type *Ty = GV->getValueType();
+    Align A = std::max(GV->getAlign().valueOrOne(), DL.getABITypeAlign(Ty));
+    uint64_t Padded = alignTo(Offset, A);
+    if (Padded != Offset) {
+      auto *PadTy = ArrayType::get(I8Ty, Padded - Offset);
+      FieldTys.push_back(PadTy);
+      Fields.push_back(ConstantAggregateZero::get(PadTy));
+    }
+    FieldIndex.push_back(Fields.size());
+    FieldTys.push_back(Ty);
+    Fields.push_back(GV->getInitializer());
+    Offset = Padded + DL.getTypeAllocSize(Ty);
+  }
+
+  auto *STy = StructType::get(Ctx, FieldTys, /*isPacked=*/true);
+  auto *Block = new GlobalVariable(M, STy, IsConstant,
+                                   GlobalValue::PrivateLinkage, nullptr, Name);
+  Block->setAlignment(Align(CacheLineSize));
+  Block->setInitializer(ConstantStruct::get(STy, Fields));
+  // Without an owner, but pinned at the end like the globals it replaces
+  Block->setMetadata(OwnerMDName, MDNode::get(Ctx, {}));
+
+  // Fields may refer to each other or to themselves, RAUW also rewrites the
+  // block initializer
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  for (unsigned I = 0; I < GVs.size(); ++I) {
+    Constant *Idx[] = {ConstantInt::get(I32Ty, 0),
+                       ConstantInt::get(I32Ty, FieldIndex[I])};
+    GVs[I]->replaceAllUsesWith(
+        ConstantExpr::getInBoundsGetElementPtr(STy, Block, Idx));
+    GVs[I]->eraseFromParent();
+    ++PackedGlobals;
+  }
+  return Block;
+}
+
+bool llvm::packObfuscationData(Module &M) {
+  DenseMap<Function *, unsigned> FuncOrder;
+  for (Function &F : M)
+    FuncOrder[&F] = FuncOrder.size();
+
+  SmallVector<std::pair<unsigned, GlobalVariable *>, 64> Owned;
+  for (GlobalVariable &GV : M.globals()) {
+    Function *Owner = getObfuscationDataOwner(&GV);
+    if (!Owner || !GV.hasInitializer() || !GV.hasLocalLinkage() ||
+        GV.isThreadLocal() || GV.hasSection() || GV.hasComdat())
+      continue;
+    Owned.push_back({FuncOrder.lookup(Owner), &GV});
+  }
+  if (Owned.empty())
+    return false;
+
+  // Keep each function's data contiguous and in function order
+  llvm::stable_sort(Owned, [](const auto &A, const auto &B) {
+    return A.first < B.first;
+  });
+
+  SmallVector<GlobalVariable *, 64> RO, RW;
+  DenseMap<Constant *, GlobalVariable *> Unique;
+  for (auto &[Order, GV] : Owned) {
+    if (!GV->isConstant()) {
+      RW.push_back(GV);
+      continue;
+    }
+    // Constants are uniqued, equal initializers are the same pointer
+    auto [It, Inserted] = Unique.try_emplace(GV->getInitializer(), GV);
+    if (Inserted) {
+      RO.push_back(GV);
+      continue;
+    }
+    GlobalVariable *Canonical = It->second;
+    Canonical->setAlignment(
+        std::max(Canonical->getAlign().valueOrOne(), GV->getAlign().valueOrOne()));
+    GV->replaceAllUsesWith(Canonical);
+    GV->eraseFromParent();
+    ++DedupedGlobals;
+  }
+
+  if (!RO.empty())
+    createDataBlock(M, RO, true, "irobf.rodata");
+  if (!RW.empty())
+    createDataBlock(M, RW, false, "irobf.data");
+  return true;
+}
+
+bool llvm::associateObfuscationData(Module &M) {
+  bool IsELF = Triple(M.getTargetTriple()).isOSBinFormatELF();
+  bool Changed = false;
+  for (GlobalVariable &GV : M.globals()) {
+    Function *Owner = getObfuscationDataOwner(&GV);
+    if (!Owner || Owner->isDeclaration() || !GV.hasLocalLinkage() ||
+        GV.hasSection() || GV.hasComdat())
+      continue;
+    // A comdat group is dropped as a whole, otherwise an ELF SHF_LINK_ORDER
+    // section is dropped together with the section of its function
+    if (Comdat *C = Owner->getComdat()) {
+      GV.setComdat(C);
+    } else if (IsELF) {
+      GV.setMetadata(LLVMContext::MD_associated,
+                     MDNode::get(M.getContext(), ValueAsMetadata::get(Owner)));
+    } else {
+      continue;
+    }
+    ++AssociatedGlobals;
+    Changed = true;
+  }
+  return Changed;
+}
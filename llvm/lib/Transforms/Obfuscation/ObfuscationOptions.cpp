@@ -3,7 +3,9 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationBudget.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Module.h"
@@ -11,33 +13,29 @@
 #include "llvm/Support/JSON.h"
 #include "llvm/Support/Regex.h"
 #include <fstream>
+#include <optional>
 #include <regex>
 
 using namespace llvm;
 
 namespace llvm {
 
-SmallVector<std::string> readAnnotate(Function *f) {
-  SmallVector<std::string> annotations;
-
-  auto *Annotations = f->getParent()->getGlobalVariable(
-      "llvm.global.annotations");
+// Calls Callback for every (function, string) entry of llvm.global.annotations
+template <typename CallbackTy>
+static void forEachAnnotation(Module &M, CallbackTy Callback) {
+  auto *Annotations = M.getGlobalVariable("llvm.global.annotations");
   auto *C = dyn_cast_or_null<Constant>(Annotations);
   if (!C || C->getNumOperands() != 1)
-    return annotations;
+    return;
 
   C = cast<Constant>(C->getOperand(0));
 
-  // Iterate over all entries in C and attach !annotation metadata to suitable
-  // entries.
   for (auto &Op : C->operands()) {
-    // Look at the operands to check if we can use the entry to generate
-    // !annotation metadata.
     auto *OpC = dyn_cast<ConstantStruct>(&Op);
     if (!OpC || OpC->getNumOperands() < 2)
       continue;
     auto *Fn = dyn_cast<Function>(OpC->getOperand(0)->stripPointerCasts());
-    if (Fn != f)
+    if (!Fn)
       continue;
     auto *StrC = dyn_cast<GlobalValue>(OpC->getOperand(1)->stripPointerCasts());
     if (!StrC)
@@ -45,8 +43,25 @@ SmallVector<std::string> readAnnotate(Function *f) {
     auto *StrData = dyn_cast<ConstantDataSequential>(StrC->getOperand(0));
     if (!StrData)
       continue;
-    annotations.emplace_back(StrData->getAsString());
+    Callback(Fn, StrData->getAsString());
   }
+}
+
+SmallVector<std::string> readAnnotate(Function *f) {
+  SmallVector<std::string> annotations;
+
+  // Carried over by -irobf-split-jobs, the partition may lack the global
+  if (MDNode *MD = f->getMetadata("irobf.annotate")) {
+    for (const MDOperand &Op : MD->operands()) {
+      annotations.emplace_back(cast<MDString>(Op)->getString());
+    }
+    return annotations;
+  }
+
+  forEachAnnotation(*f->getParent(), [&](Function *Fn, StringRef Str) {
+    if (Fn == f)
+      annotations.emplace_back(Str);
+  });
   return annotations;
 }
 
@@ -118,72 +133,167 @@ std::shared_ptr<ObfuscationOptions> ObfuscationOptions::readConfigFile(
       }
     }
     if (!objHit) {
+      StringRef key = obj.getFirst();
+      if (key == "budget-size" || key == "budget-cycles") {
+        if (auto value = obj.getSecond().getAsInteger()) {
+          uint32_t percent = static_cast<uint32_t>(*value);
+          if (key == "budget-size") {
+            result->BudgetSizePercent = percent;
+          } else {
+            result->BudgetCyclePercent = percent;
+          }
+          continue;
+        }
+      }
       errs() << "warning: unknown arkari config node: " << obj.getFirst().str() << '\n';
     }
   }
   return result;
 }
 
-static bool match_regex_full(const std::string& name, const std::string& rule) {
-  return Regex(rule).match(name);
+FunctionRuleMatcher::Rule FunctionRuleMatcher::compile(unsigned index,
+                                                       bool skip,
+                                                       StringRef pattern) {
+  Rule rule{index, skip, Kind::Any, "", nullptr};
+  if (pattern.starts_with("=")) {
+    return rule;
+  }
+
+  // Rules are searched, not anchored, unless they say so
+  StringRef text = pattern;
+  bool begin = text.consume_front("^");
+  bool end = text.consume_back("$");
+  if (text.find_first_of(".[]()*+?{}|\\^$") == StringRef::npos) {
+    rule.Text = text.str();
+    rule.K = begin && end ? Kind::Exact
+             : begin      ? Kind::Prefix
+             : end        ? Kind::Suffix
+                          : Kind::Contains;
+    return rule;
+  }
+
+  rule.RE = std::make_shared<llvm::Regex>(pattern);
+  rule.K = rule.RE->isValid() ? Kind::Regex : Kind::Never;
+  return rule;
 }
 
-static void appendFuntionMatchRules(SmallVector<std::string>& list, const std::string& name, 
-                                    std::vector<std::pair<std::vector<std::string>, std::string>>& functionConfig) {
-  for (const auto& matchRule : functionConfig) {
-    bool skipFound = false;
-    bool anyFound = false;
-    for (const auto& matchFunc : matchRule.first) {
-      if (matchFunc[0] == '@') {
-        if (matchFunc[1] == '!') {
-          if (matchFunc[2] == '=' || match_regex_full(linkCurrentModuleSource(), matchFunc.substr(2))) {
-            skipFound = true;
-            break;
-          }
-        }
-        else if (matchFunc[1] == '=' || match_regex_full(linkCurrentModuleSource(), matchFunc.substr(1))) {
-          anyFound = true;
-          break;
-        }
+bool FunctionRuleMatcher::matches(const Rule &rule, StringRef name) {
+  switch (rule.K) {
+  case Kind::Any:
+    return true;
+  case Kind::Never:
+    return false;
+  case Kind::Exact:
+    return name == rule.Text;
+  case Kind::Prefix:
+    return name.starts_with(rule.Text);
+  case Kind::Suffix:
+    return name.ends_with(rule.Text);
+  case Kind::Contains:
+    return name.contains(rule.Text);
+  case Kind::Regex:
+    return rule.RE->match(name);
+  }
+  llvm_unreachable("unknown rule kind");
+}
+
+void FunctionRuleMatcher::addGroup(ArrayRef<std::string> rules,
+                                   const std::string &annotation) {
+  unsigned groupIndex = Groups.size();
+  Group &group = Groups.emplace_back();
+  group.Annotation = annotation;
+  for (unsigned i = 0; i < rules.size(); ++i) {
+    StringRef text = rules[i];
+    bool module = text.consume_front("@");
+    bool skip = text.consume_front("!");
+    Rule rule = compile(i, skip, text);
+    if (module) {
+      group.ModuleRules.push_back(std::move(rule));
+    } else if (rule.K == Kind::Exact) {
+      ExactNames[rule.Text].emplace_back(groupIndex, i, skip);
+    } else {
+      group.FunctionRules.push_back(std::move(rule));
+    }
+  }
+}
+
+SmallVector<FunctionRuleMatcher::ModuleMatch>
+FunctionRuleMatcher::matchModule(StringRef moduleName) const {
+  SmallVector<ModuleMatch> result(Groups.size());
+  for (unsigned g = 0; g < Groups.size(); ++g) {
+    for (const Rule &rule : Groups[g].ModuleRules) {
+      if (matches(rule, moduleName)) {
+        result[g] = {rule.Index, rule.Skip};
+        break;
       }
-      else if (matchFunc[0] == '!') {
-        if (matchFunc[1] == '=' || match_regex_full(name, matchFunc.substr(1))) {
-          skipFound = true;
-          break;
-        }
+    }
+  }
+  return result;
+}
+
+void FunctionRuleMatcher::appendMatches(
+    SmallVector<std::string> &list, StringRef functionName,
+    ArrayRef<ModuleMatch> moduleMatches) const {
+  // The first rule of a group that fires, in file order, decides it
+  SmallVector<ModuleMatch> first(moduleMatches.begin(), moduleMatches.end());
+  auto exact = ExactNames.find(functionName);
+  if (exact != ExactNames.end()) {
+    for (const auto &[g, index, skip] : exact->second) {
+      if (index < first[g].Index) {
+        first[g] = {index, skip};
+      }
+    }
+  }
+
+  for (unsigned g = 0; g < Groups.size(); ++g) {
+    for (const Rule &rule : Groups[g].FunctionRules) {
+      if (rule.Index >= first[g].Index) {
+        break;
       }
-      else if (matchFunc[0] == '=' || match_regex_full(name, matchFunc)) {
-        anyFound = true;
+      if (matches(rule, functionName)) {
+        first[g] = {rule.Index, rule.Skip};
         break;
       }
     }
-    if (!skipFound && anyFound) {
-      list.push_back(matchRule.second);
+    if (first[g].Index != ~0u && !first[g].Skip) {
+      list.push_back(Groups[g].Annotation);
     }
   }
 }
 
-ObfOpt ObfuscationOptions::toObfuscate(const std::shared_ptr<ObfOpt> &option,
-                                       Function *                     f) {
+// Reads N from a "^name = N" annotation
+static bool readAnnotationValue(const std::string &annotation,
+                                const std::string &attr, uint32_t &value) {
+  const auto attrPos = annotation.find(attr);
+  if (attrPos == std::string::npos) {
+    return false;
+  }
+  const auto equalPos = annotation.find('=', attrPos + 1);
+  if (equalPos == std::string::npos) {
+    return false;
+  }
+  for (size_t i = attrPos + attr.length(); i < equalPos; ++i) {
+    if (annotation[i] != ' ') {
+      return false;
+    }
+  }
+  value = std::strtoul(annotation.c_str() + equalPos + 1, 0, 0);
+  return true;
+}
+
+// Resolves option against the annotations and matched config rules of one
+// function
+static ObfOpt resolveOpt(const std::shared_ptr<ObfOpt> &option,
+                         ArrayRef<std::string>          annotations) {
   const auto attrEnable = "+" + option->attributeName();
   const auto attrDisable = "-" + option->attributeName();
   const auto attrLevel = "^" + option->attributeName();
   auto       result = option->none();
-  if (f->isDeclaration()) {
-    return result;
-  }
-
-  if (f->hasAvailableExternallyLinkage() != 0) {
-    return result;
-  }
 
   bool annotationEnableFound = option->isEnabled();
   bool annotationDisableFound = false;
   uint32_t annotationSetLevel = option->level();
 
-  auto annotations = readAnnotate(f);
-  appendFuntionMatchRules(annotations, f->getName().str(), option->owner()->FunctionConfig);
-
   if (!annotations.empty()) {
     for (const auto &annotation : annotations) {
       if (annotation.find(attrDisable) != std::string::npos) {
@@ -193,21 +303,7 @@ ObfOpt ObfuscationOptions::toObfuscate(const std::shared_ptr<ObfOpt> &option,
       if (annotation.find(attrEnable) != std::string::npos) {
         annotationEnableFound = true;
       }
-      if (const auto levelPos = annotation.find(attrLevel); levelPos != std::string::npos) {
-        if (const auto equalPos = annotation.find('=', levelPos + 1); equalPos != std::string::npos) {
-          int32_t    level = 0;
-          for (size_t i = levelPos + attrLevel.length(); i < equalPos; ++i) {
-            if (annotation[i] != ' ') {
-              level = -1;
-              break;
-            }
-          }
-          if (level == -1) {
-            continue;
-          }
-          annotationSetLevel = std::strtoul(annotation.c_str() + equalPos + 1, 0, 0);
-        }
-      }
+      readAnnotationValue(annotation, attrLevel, annotationSetLevel);
     }
   }
 
@@ -216,6 +312,121 @@ ObfOpt ObfuscationOptions::toObfuscate(const std::shared_ptr<ObfOpt> &option,
   return result;
 }
 
+static const char *FunctionOptsMD = "irobf.opts";
+
+ObfOpt ObfuscationOptions::toObfuscate(const std::shared_ptr<ObfOpt> &option,
+                                       Function *                     f) {
+  auto result = option->none();
+  if (f->isDeclaration()) {
+    return result;
+  }
+
+  if (f->hasAvailableExternallyLinkage() != 0) {
+    return result;
+  }
+
+  const ObfuscationOptions *owner = option->owner();
+  auto it = owner->FunctionIndex.find(f);
+  if (it != owner->FunctionIndex.end()) {
+    result.setEnable(it->second.Enabled[option->slot()]);
+    result.setLevel(it->second.Level[option->slot()]);
+    return result;
+  }
+
+  // Split partitions carry what the index resolved, including the budget
+  if (MDNode *MD = f->getMetadata(FunctionOptsMD)) {
+    const unsigned slot = option->slot();
+    auto field = [&](unsigned i) {
+      return mdconst::extract<ConstantInt>(MD->getOperand(i))->getZExtValue();
+    };
+    result.setEnable(field(2 * slot) != 0);
+    result.setLevel(field(2 * slot + 1));
+    return result;
+  }
+
+  // Functions created after the index was built
+  auto annotations = readAnnotate(f);
+  const auto &config = owner->FunctionConfig;
+  if (!config.empty()) {
+    config.appendMatches(annotations, f->getName(),
+                         config.matchModule(linkCurrentModuleSource()));
+  }
+  return resolveOpt(option, annotations);
+}
+
+void ObfuscationOptions::buildFunctionIndex(Module &M) {
+  FunctionIndex.clear();
+  std::fill(std::begin(EnabledAnywhere), std::end(EnabledAnywhere), false);
+  Indexed = true;
+
+  DenseMap<const Function *, SmallVector<std::string>> annotationMap;
+  forEachAnnotation(M, [&](Function *Fn, StringRef Str) {
+    annotationMap[Fn].emplace_back(Str);
+  });
+
+  const auto allOpt = getAllOpt();
+  const auto moduleMatches =
+      FunctionConfig.matchModule(linkCurrentModuleSource());
+  std::optional<TargetTransformInfo> defaultTTI;
+  FunctionIndex.reserve(M.size());
+  for (Function &F : M) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage()) {
+      continue;
+    }
+    // Split partitions carry their annotations on the function
+    SmallVector<std::string> annotations =
+        F.hasMetadata("irobf.annotate") ? readAnnotate(&F)
+                                        : annotationMap.lookup(&F);
+    FunctionConfig.appendMatches(annotations, F.getName(), moduleMatches);
+
+    FunctionOpts &opts = FunctionIndex[&F];
+    for (const auto &opt : allOpt) {
+      ObfOpt resolved = resolveOpt(opt, annotations);
+      opts.Enabled[opt->slot()] = resolved.isEnabled();
+      opts.Level[opt->slot()] = resolved.level();
+    }
+
+    ObfuscationBudget budget{BudgetSizePercent, BudgetCyclePercent};
+    for (const auto &annotation : annotations) {
+      readAnnotationValue(annotation, "^budget-size", budget.SizePercent);
+      readAnnotationValue(annotation, "^budget-cycles", budget.CyclePercent);
+    }
+    if (budget.enabled()) {
+      const TargetTransformInfo *TTI = getTTI(F);
+      if (!TTI) {
+        if (!defaultTTI) {
+          defaultTTI.emplace(M.getDataLayout());
+        }
+        TTI = &*defaultTTI;
+      }
+      fitObfuscationBudget(F, *TTI, budget, allOpt, opts);
+    }
+
+    for (unsigned slot = 0; slot < NumOpts; ++slot) {
+      EnabledAnywhere[slot] |= opts.Enabled[slot];
+    }
+  }
+}
+
+void ObfuscationOptions::attachFunctionOpts(Module &M) const {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  for (Function &F : M) {
+    auto it = FunctionIndex.find(&F);
+    if (it == FunctionIndex.end()) {
+      continue;
+    }
+    SmallVector<Metadata *, 2 * NumOpts> ops;
+    for (unsigned slot = 0; slot < NumOpts; ++slot) {
+      ops.push_back(ConstantAsMetadata::get(
+          ConstantInt::get(Int32Ty, it->second.Enabled[slot])));
+      ops.push_back(ConstantAsMetadata::get(
+          ConstantInt::get(Int32Ty, it->second.Level[slot])));
+    }
+    F.setMetadata(FunctionOptsMD, MDTuple::get(Ctx, ops));
+  }
+}
+
 static bool getPureLine(std::ifstream& input, std::string& line) {
   if (std::getline(input, line)) {
     if (*line.rbegin() == '\n') {
@@ -248,7 +459,7 @@ void ObfuscationOptions::loadFunctionConfig(const Twine &configPathOpt) {
     }
     if (std::regex_search(line, annotationRule)) {
       if (!annotation.empty() && !function.empty()) {
-        FunctionConfig.emplace_back(std::pair(function, annotation));
+        FunctionConfig.addGroup(function, annotation);
         function.clear();
       }
       annotation = line;
@@ -259,7 +470,7 @@ void ObfuscationOptions::loadFunctionConfig(const Twine &configPathOpt) {
     }
   }
   if (!annotation.empty() && !function.empty()) {
-    FunctionConfig.emplace_back(std::pair(function, annotation));
+    FunctionConfig.addGroup(function, annotation);
   }
 }
 
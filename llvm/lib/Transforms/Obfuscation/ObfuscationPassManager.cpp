@@ -1,9 +1,19 @@
 #include "llvm/Transforms/Obfuscation/ObfuscationPassManager.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationData.h"
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 #include "llvm/IR/Module.h"
 
@@ -103,6 +113,74 @@ static cl::opt<uint32_t> LevelIRConstantFPEncryption(
     cl::desc("Set IR Constant FP Encryption Level, from 0 to 3."),
     cl::ZeroOrMore);
 
+static cl::opt<bool> EnableRelativeTable(
+    "irobf-relative-table", cl::init(false), cl::NotHidden,
+    cl::desc("Use 32-bit table relative offsets in indirect branch, call and "
+             "global variable tables, avoiding dynamic relocations."),
+    cl::ZeroOrMore);
+
+static cl::opt<bool> EnableHoistKeys(
+    "irobf-indirect-hoist", cl::init(false), cl::NotHidden,
+    cl::desc("Decode the indirect branch, call and global variable keys once "
+             "per function and reuse dominating decoded addresses."),
+    cl::ZeroOrMore);
+
+static cl::opt<bool> EnablePackData(
+    "irobf-pack-data", cl::init(false), cl::NotHidden,
+    cl::desc("Pack the keys, tables and encrypted constants of all "
+             "obfuscated functions into cache-line aligned data blocks."),
+    cl::ZeroOrMore);
+
+static cl::opt<bool> EnableAssociateData(
+    "irobf-associate-data", cl::init(false), cl::NotHidden,
+    cl::desc("Tie the keys, tables and encrypted constants of each function "
+             "to that function so the linker garbage collects them together. "
+             "Takes precedence over -irobf-pack-data."),
+    cl::ZeroOrMore);
+
+static cl::opt<std::string> ObfuscationSeed(
+    "irobf-seed", cl::init(std::string{}), cl::NotHidden,
+    cl::desc("Derive the random choices of every pass and function from this "
+             "seed, the module identifier and the function name, making the "
+             "output reproducible."),
+    cl::ZeroOrMore);
+
+static cl::opt<unsigned> ObfuscationSplitJobs(
+    "irobf-split-jobs", cl::init(0), cl::NotHidden,
+    cl::desc("Split the module into this many partitions and run the "
+             "function level obfuscation passes on them in parallel, each in "
+             "its own context, then link them back. 0 or 1 disables it."),
+    cl::ZeroOrMore);
+
+static cl::opt<bool> FusedFunctionPasses(
+    "irobf-fused", cl::init(false), cl::NotHidden,
+    cl::desc("Run the whole function level obfuscation sequence on one "
+             "function before moving to the next, instead of one pass over "
+             "the whole module at a time."),
+    cl::ZeroOrMore);
+
+static cl::opt<uint32_t> BudgetSize(
+    "irobf-budget-size", cl::init(0), cl::NotHidden,
+    cl::desc("Lower the levels of, or turn off, the obfuscations of a "
+             "function until its estimated instruction count stays within "
+             "this percentage of the original, e.g. 200 for at most 2x. 0 "
+             "disables it."),
+    cl::ZeroOrMore);
+
+static cl::opt<uint32_t> BudgetCycles(
+    "irobf-budget-cycles", cl::init(0), cl::NotHidden,
+    cl::desc("Lower the levels of, or turn off, the obfuscations of a "
+             "function until its estimated cycle increase stays within this "
+             "percentage, using the target cost model. 0 disables it."),
+    cl::ZeroOrMore);
+
+static cl::opt<unsigned> TimeTraceFunctionInsts(
+    "irobf-time-trace-function-insts", cl::init(0), cl::NotHidden,
+    cl::desc("Under -ftime-trace, also emit an event for every pass run on a "
+             "function with at least this many instructions. 0 disables the "
+             "per-function events."),
+    cl::ZeroOrMore);
+
 static cl::opt<std::string>
     ArkariConfigPath("irobf-config", cl::init(std::string{}), cl::NotHidden,
                      cl::desc("Arkari config path."), cl::ZeroOrMore);
@@ -112,11 +190,121 @@ ObfuscationConfigPath("ollvm-config", cl::init(std::string{}), cl::NotHidden,
                  cl::desc("Function config path.\nFormat: >>>\n+sub,-fla,^bcf=80:\nfunction rules\n<<<"),
                  cl::ZeroOrMore);
 
+static const char SplitAnnotationMD[] = "irobf.annotate";
+
+namespace {
+// Local symbols that SplitModule externalizes, restored after linking
+struct SplitLocal {
+  std::string Name;
+  GlobalValue::LinkageTypes Linkage;
+};
+} // namespace
+
+// SplitModule turns every local into a hidden external symbol so that
+// partitions can reference each other. Remember them (naming the unnamed
+// ones) so the merged module keeps its original linkage.
+static std::vector<SplitLocal> collectSplitLocals(Module &M) {
+  std::vector<SplitLocal> Locals;
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage()) {
+      continue;
+    }
+    if (!GV.hasName()) {
+      GV.setName("irobf.split");
+    }
+    Locals.push_back({GV.getName().str(), GV.getLinkage()});
+  }
+  return Locals;
+}
+
+static void restoreSplitLocals(Module &M, ArrayRef<SplitLocal> Locals) {
+  for (const SplitLocal &L : Locals) {
+    if (GlobalValue *GV = M.getNamedValue(L.Name)) {
+      GV->setVisibility(GlobalValue::DefaultVisibility);
+      GV->setLinkage(L.Linkage);
+    }
+  }
+}
+
+// Partitions only hold llvm.global.annotations in one of them, keep each
+// function's annotations on the function itself while it is split
+static void attachSplitAnnotations(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    SmallVector<Metadata *, 4> Ops;
+    for (const std::string &A : readAnnotate(&F)) {
+      Ops.push_back(MDString::get(Ctx, A));
+    }
+    if (!Ops.empty()) {
+      F.setMetadata(SplitAnnotationMD, MDTuple::get(Ctx, Ops));
+    }
+  }
+}
+
+// Remove every definition from M so the partitions can be linked back into
+// it, keeping the identifier, triple and data layout
+static void clearModule(Module &M) {
+  M.dropAllReferences();
+  for (GlobalValue &GV : M.global_values()) {
+    GV.removeDeadConstantUsers();
+  }
+  while (!M.ifunc_empty()) {
+    M.ifunc_begin()->eraseFromParent();
+  }
+  while (!M.alias_empty()) {
+    M.alias_begin()->eraseFromParent();
+  }
+  while (!M.empty()) {
+    M.begin()->eraseFromParent();
+  }
+  while (!M.global_empty()) {
+    M.global_begin()->eraseFromParent();
+  }
+  while (!M.named_metadata_empty()) {
+    M.eraseNamedMetadata(&*M.named_metadata_begin());
+  }
+  // A leftover comdat would make the linker keep the (now empty) dest side
+  M.getComdatSymbolTable().clear();
+  M.setModuleInlineAsm("");
+}
+
+// Every partition carries a copy of the named metadata, uniqued nodes such
+// as llvm.ident end up listed once per partition after linking
+static void dedupNamedMetadata(Module &M) {
+  for (NamedMDNode &NMD : M.named_metadata()) {
+    if (NMD.getName() == "llvm.module.flags") {
+      continue;
+    }
+    SmallVector<MDNode *, 8> Ops;
+    SmallPtrSet<MDNode *, 8> Seen;
+    for (MDNode *Op : NMD.operands()) {
+      if (Seen.insert(Op).second) {
+        Ops.push_back(Op);
+      }
+    }
+    if (Ops.size() == NMD.getNumOperands()) {
+      continue;
+    }
+    NMD.clearOperands();
+    for (MDNode *Op : Ops) {
+      NMD.addOperand(Op);
+    }
+  }
+}
+
 namespace llvm {
 
 struct ObfuscationPassManager : public ModulePass {
   static char            ID; // Pass identification
   SmallVector<Pass *> Passes;
+  TTIGetterTy         GetTTI;
+
+  // -ftime-report 下每个混淆 Pass 一个计时器
+  std::unique_ptr<TimerGroup>       Timers;
+  StringMap<std::unique_ptr<Timer>> PassTimers;
 
   ObfuscationPassManager() : ModulePass(ID) {
     initializeObfuscationPassManagerPass(*PassRegistry::getPassRegistry());
@@ -161,10 +349,126 @@ struct ObfuscationPassManager : public ModulePass {
 
     writeModuleFunctionNameOfFile(M);
 
+    bool Change = runPasses(M);
+
+    linkCurrentModuleSource() = "";
+    return Change;
+  }
+
+  Timer *getPassTimer(Pass *P) {
+    if (!Timers) {
+      return nullptr;
+    }
+    std::unique_ptr<Timer> &T = PassTimers[P->getPassName()];
+    if (!T) {
+      T = std::make_unique<Timer>(P->getPassName(), P->getPassName(), *Timers);
+    }
+    return T.get();
+  }
+
+  // What a function pass did to a function, for the optimization remarks
+  struct FunctionShape {
+    unsigned Instructions = 0;
+    unsigned Blocks = 0;
+    unsigned IndirectBranches = 0;
+    unsigned IndirectCalls = 0;
+    unsigned Globals = 0;
+
+    explicit FunctionShape(Function &F) {
+      for (BasicBlock &BB : F) {
+        ++Blocks;
+        for (Instruction &I : BB) {
+          ++Instructions;
+          if (isa<IndirectBrInst>(I)) {
+            ++IndirectBranches;
+          } else if (auto *CB = dyn_cast<CallBase>(&I)) {
+            IndirectCalls += CB->isIndirectCall();
+          }
+        }
+      }
+      Globals = F.getParent()->global_size();
+    }
+  };
+
+  static unsigned added(unsigned Before, unsigned After) {
+    return After > Before ? After - Before : 0;
+  }
+
+  static bool runOnFunction(FunctionPass *P, Function &F) {
+    if (F.isDeclaration() || !obfuscationRemarksEnabled(F)) {
+      return runTraced(P, F);
+    }
+
+    FunctionShape Before(F);
+    bool Changed = runTraced(P, F);
+    if (!Changed) {
+      return false;
+    }
+    FunctionShape After(F);
+
+    using NV = DiagnosticInfoOptimizationBase::Argument;
+    OptimizationRemark Remark(DEBUG_TYPE, P->getPassName(), &F);
+    Remark << P->getPassName() << ": "
+           << NV("InstructionsBefore", Before.Instructions) << " -> "
+           << NV("InstructionsAfter", After.Instructions) << " instructions, "
+           << NV("BlocksBefore", Before.Blocks) << " -> "
+           << NV("BlocksAfter", After.Blocks) << " blocks, "
+           << NV("NewGlobals", added(Before.Globals, After.Globals))
+           << " new globals, "
+           << NV("NewIndirectBranches",
+                 added(Before.IndirectBranches, After.IndirectBranches))
+           << " indirect branches and "
+           << NV("NewIndirectCalls",
+                 added(Before.IndirectCalls, After.IndirectCalls))
+           << " indirect calls added";
+    F.getContext().diagnose(Remark);
+    return true;
+  }
+
+  // Per-function trace events are only worth it on large functions, the
+  // time trace granularity drops the short ones anyway
+  static bool runTraced(FunctionPass *P, Function &F) {
+    if (TimeTraceFunctionInsts == 0 || !timeTraceProfilerEnabled() ||
+        F.isDeclaration()) {
+      return P->runOnFunction(F);
+    }
+    unsigned Insts = F.getInstructionCount();
+    if (Insts < TimeTraceFunctionInsts) {
+      return P->runOnFunction(F);
+    }
+    TimeTraceScope Scope(P->getPassName(), [&] {
+      return (F.getName() + " (" + Twine(Insts) + " instructions)").str();
+    });
+    return P->runOnFunction(F);
+  }
+
+  static std::string traceDetail(Module &M) {
+    size_t Insts = 0;
+    for (Function &F : M) {
+      Insts += F.getInstructionCount();
+    }
+    return (M.getModuleIdentifier() + " (" + Twine(Insts) + " instructions)")
+        .str();
+  }
+
+  bool runPasses(Module &M) {
     bool Change = false;
-    for (Pass *P : Passes) {
+    for (size_t I = 0; I < Passes.size(); ++I) {
+      Pass *P = Passes[I];
       switch (P->getPassKind()) {
       case PassKind::PT_Function:
+        if (FusedFunctionPasses) {
+          // Consecutive function passes, module passes stay at the boundary
+          size_t E = I + 1;
+          while (E < Passes.size() &&
+                 Passes[E]->getPassKind() == PassKind::PT_Function) {
+            ++E;
+          }
+          Change |= runFusedFunctionPasses(
+              M, ArrayRef<Pass *>(Passes).slice(I, E - I));
+          I = E - 1;
+          break;
+        }
         Change |= runFunctionPass(M, (FunctionPass *)P);
         break;
       case PassKind::PT_Module:
@@ -174,20 +478,35 @@ struct ObfuscationPassManager : public ModulePass {
         continue;
       }
     }
-
-    linkCurrentModuleSource() = "";
     return Change;
   }
 
   bool runFunctionPass(Module &M, FunctionPass *P) {
+    TimeTraceScope Scope(P->getPassName(), [&] { return traceDetail(M); });
+    TimeRegion     Region(getPassTimer(P));
+    bool Changed = false;
+    for (Function &F : M) {
+      Changed |= runOnFunction(P, F);
+    }
+    return Changed;
+  }
+
+  // Push each function through the whole sequence while its IR is still hot
+  bool runFusedFunctionPasses(Module &M, ArrayRef<Pass *> FPasses) {
+    TimeTraceScope Scope("FusedFunctionPasses", [&] { return traceDetail(M); });
     bool Changed = false;
     for (Function &F : M) {
-      Changed |= P->runOnFunction(F);
+      for (Pass *P : FPasses) {
+        TimeRegion Region(getPassTimer(P));
+        Changed |= runOnFunction((FunctionPass *)P, F);
+      }
     }
     return Changed;
   }
 
   bool runModulePass(Module &M, ModulePass *P) {
+    TimeTraceScope Scope(P->getPassName(), [&] { return traceDetail(M); });
+    TimeRegion     Region(getPassTimer(P));
     return P->runOnModule(M);
   }
 
@@ -204,48 +523,197 @@ struct ObfuscationPassManager : public ModulePass {
     Opt->cieOpt()->readOpt(EnableIRConstantIntEncryption, LevelIRConstantIntEncryption);
     Opt->cfeOpt()->readOpt(EnableIRConstantFPEncryption, LevelIRConstantFPEncryption);
 
+    Opt->setRelativeTable(EnableRelativeTable);
+    Opt->setHoistKeys(EnableHoistKeys);
+    Opt->setSeed(ObfuscationSeed);
+    if (BudgetSize.getNumOccurrences() || BudgetCycles.getNumOccurrences()) {
+      Opt->setBudget(BudgetSize, BudgetCycles);
+    }
+
     Opt->loadFunctionConfig(ObfuscationConfigPath);
     return Opt;
   }
 
-  bool runOnModule(Module &M) override {
+  // Passes that no function of the module enables are not created at all
+  void addFunctionPasses(ObfuscationOptions *Options, unsigned pointerSize) {
+    if (Options->enabledAnywhere(Options->bcfOpt())) {
+      add(llvm::createBogusControlFlow2Pass(Options));
+    }
+
+    if (Options->enabledAnywhere(Options->flaOpt())) {
+      add(llvm::createFlatteningPass(pointerSize, Options));
+    }
 
-    if (EnableIndirectBr || EnableIndirectCall || EnableIndirectGV ||
-        EnableIRFlattening || EnableIRSubstitution || EnableBogusFlow ||
-        EnableIRStringEncryption || EnableIRConstantIntEncryption ||
-        EnableIRConstantFPEncryption || !ArkariConfigPath.empty()) {
-      EnableIRObfuscation = true;
+    if (Options->enabledAnywhere(Options->subOpt())) {
+      add(llvm::createSubstitutionPass(Options));
     }
 
-    if (!EnableIRObfuscation) {
+    if (Options->enabledAnywhere(Options->cieOpt())) {
+      add(llvm::createConstantIntEncryptionPass(Options));
+    }
+    if (Options->enabledAnywhere(Options->cfeOpt())) {
+      add(llvm::createConstantFPEncryptionPass(Options));
+    }
+
+    if (Options->enabledAnywhere(Options->iCallOpt())) {
+      add(llvm::createIndirectCallPass(pointerSize, Options));
+    }
+
+    if (Options->enabledAnywhere(Options->indBrOpt())) {
+      add(llvm::createIndirectBranchPass(pointerSize, Options));
+    }
+
+    if (Options->enabledAnywhere(Options->indGvOpt())) {
+      add(llvm::createIndirectGlobalVariablePass(pointerSize, Options));
+    }
+  }
+
+  // Split M into partitions, obfuscate each one in its own LLVMContext on a
+  // thread pool and link the results back into M. Partitions go through
+  // bitcode to move between contexts. No TTI is available there, passes
+  // fall back to the data layout cost model.
+  static bool runSplit(Module &M, ObfuscationOptions *Options,
+                       unsigned pointerSize, unsigned Jobs) {
+    std::string ModuleID = M.getModuleIdentifier();
+    std::vector<SplitLocal> Locals = collectSplitLocals(M);
+    attachSplitAnnotations(M);
+    Options->attachFunctionOpts(M);
+
+    std::vector<SmallVector<char, 0>> Parts;
+    SplitModule(M, Jobs, [&](std::unique_ptr<Module> MPart) {
+      raw_svector_ostream OS(Parts.emplace_back());
+      WriteBitcodeToFile(*MPart, OS);
+    });
+
+    // The getter queries the caller's analysis manager, which is neither
+    // thread safe nor aware of the partition contexts. Workers only read the
+    // shared options, drop it before they start
+    Options->setTTIGetter(nullptr);
+
+    std::vector<std::string> Errors(Parts.size());
+    {
+      DefaultThreadPool Pool(hardware_concurrency(Jobs));
+      for (unsigned I = 0; I < Parts.size(); ++I) {
+        Pool.async([&, I] {
+          LLVMContext Ctx;
+          auto PartOrErr = parseBitcodeFile(
+              MemoryBufferRef(StringRef(Parts[I].data(), Parts[I].size()),
+                              ModuleID),
+              Ctx);
+          if (!PartOrErr) {
+            Errors[I] = toString(PartOrErr.takeError());
+            return;
+          }
+          Module &Part = **PartOrErr;
+
+          ObfuscationPassManager Worker;
+          Worker.addFunctionPasses(Options, pointerSize);
+          linkCurrentModuleSource() = ModuleID;
+          Worker.runPasses(Part);
+          linkCurrentModuleSource() = "";
+          Worker.doFinalization(Part);
+
+          Parts[I].clear();
+          raw_svector_ostream OS(Parts[I]);
+          WriteBitcodeToFile(Part, OS);
+        });
+      }
+      Pool.wait();
+    }
+    for (const std::string &E : Errors) {
+      if (!E.empty()) {
+        report_fatal_error(Twine("irobf-split-jobs: ") + E);
+      }
+    }
+
+    Options->dropFunctionIndex();
+    clearModule(M);
+    for (SmallVector<char, 0> &Buf : Parts) {
+      auto PartOrErr = parseBitcodeFile(
+          MemoryBufferRef(StringRef(Buf.data(), Buf.size()), ModuleID),
+          M.getContext());
+      if (!PartOrErr) {
+        report_fatal_error(PartOrErr.takeError());
+      }
+      // Partitions define disjoint symbols, override so that locals and
+      // linkonce definitions are linked even before anything references them
+      if (Linker::linkModules(M, std::move(*PartOrErr),
+                              Linker::Flags::OverrideFromSrc)) {
+        report_fatal_error("irobf-split-jobs: failed to link partitions");
+      }
+      Buf = SmallVector<char, 0>();
+    }
+
+    restoreSplitLocals(M, Locals);
+    dedupNamedMetadata(M);
+    for (Function &F : M) {
+      F.setMetadata(SplitAnnotationMD, nullptr);
+      F.setMetadata("irobf.opts", nullptr);
+    }
+    return true;
+  }
+
+  bool runOnModule(Module &M) override {
+
+    // Options are only read here, concurrent pipelines share them
+    bool Enabled = EnableIRObfuscation || EnableIndirectBr ||
+                   EnableIndirectCall || EnableIndirectGV ||
+                   EnableIRFlattening || EnableIRSubstitution ||
+                   EnableBogusFlow || EnableIRStringEncryption ||
+                   EnableIRConstantIntEncryption ||
+                   EnableIRConstantFPEncryption || !ArkariConfigPath.empty();
+
+    if (!Enabled) {
       return false;
     }
 
     const auto Options(getOptions());
+    Options->setTTIGetter(GetTTI);
+
+    linkCurrentModuleSource() = M.getModuleIdentifier();
+    Options->buildFunctionIndex(M);
+    linkCurrentModuleSource() = "";
+    if (!Options->cseOpt()->isEnabled() && !Options->enabledAnywhere()) {
+      // Nothing to obfuscate, the function list is still written for
+      // -ollvm-config
+      writeModuleFunctionNameOfFile(M);
+      return false;
+    }
+
     unsigned   pointerSize = M.getDataLayout().getTypeAllocSize(
         PointerType::getUnqual(M.getContext()));
 
+    // Split workers run on their own threads and are only traced as a whole
+    if (TimePassesIsEnabled) {
+      Timers = std::make_unique<TimerGroup>("irobf",
+                                            "IR Obfuscation Pass Timing");
+    }
+
     // 这个只能全局设置，给函数加注释是没用的，因为全部字符串都会储存在全局字符串表里
     if (Options->cseOpt()->isEnabled()) {
       add(llvm::createStringEncryptionPass(Options.get()));
     }
 
-    add(llvm::createBogusControlFlow2Pass(Options.get()));
-
-    add(llvm::createFlatteningPass(pointerSize, Options.get()));
-    
-    add(llvm::createSubstitutionPass(Options.get()));
-
-    add(llvm::createConstantIntEncryptionPass(Options.get()));
-    add(llvm::createConstantFPEncryptionPass(Options.get()));
-
-    add(llvm::createIndirectCallPass(pointerSize, Options.get()));
-
-    add(llvm::createIndirectBranchPass(pointerSize, Options.get()));
-    
-    add(llvm::createIndirectGlobalVariablePass(pointerSize, Options.get()));
+    bool Changed;
+    if (ObfuscationSplitJobs > 1) {
+      // Module passes see the whole module, the rest runs per partition
+      Changed = run(M);
+      TimeTraceScope Scope("SplitFunctionPasses", [&] { return traceDetail(M); });
+      Changed |= runSplit(M, Options.get(), pointerSize, ObfuscationSplitJobs);
+    } else {
+      addFunctionPasses(Options.get(), pointerSize);
+      Changed = run(M);
+    }
 
-    bool Changed = run(M);
+    {
+      TimeTraceScope Scope("ObfuscationData");
+      if (EnableAssociateData) {
+        Changed |= associateObfuscationData(M);
+      } else if (EnablePackData) {
+        Changed |= packObfuscationData(M);
+      }
+      finalizeObfuscationData(M);
+    }
 
     return Changed;
   }
@@ -258,6 +726,12 @@ ModulePass *llvm::createObfuscationPassManager() {
   return new ObfuscationPassManager();
 }
 
+ModulePass *llvm::createObfuscationPassManager(TTIGetterTy GetTTI) {
+  auto *OPM = new ObfuscationPassManager();
+  OPM->GetTTI = std::move(GetTTI);
+  return OPM;
+}
+
 INITIALIZE_PASS_BEGIN(ObfuscationPassManager, "irobf", "Enable IR Obfuscation",
                       false, false)
 INITIALIZE_PASS_END(ObfuscationPassManager, "irobf", "Enable IR Obfuscation",
@@ -1,10 +1,12 @@
 #include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 #include "llvm/Transforms/Obfuscation/StringEncryption.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
 #include "llvm/Transforms/IPO/Attributor.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
@@ -23,7 +25,7 @@ struct StringEncryption : public ModulePass {
   static char ID;
 
   struct CSPEntry {
-    CSPEntry() : ID(0), Offset(0), DecGV(nullptr), DecStatus(nullptr), DecFunc(nullptr) {}
+    CSPEntry() : ID(0), Offset(0), DecGV(nullptr), DecStatus(nullptr), DecFunc(nullptr), DecSlowFunc(nullptr) {}
     unsigned ID;
     unsigned Offset;
     GlobalVariable *DecGV;
@@ -31,17 +33,19 @@ struct StringEncryption : public ModulePass {
     std::vector<uint8_t> Data;
     std::vector<uint8_t> EncKey;
     Function *DecFunc;
+    Function *DecSlowFunc; // cold part of DecFunc doing the decryption
   };
 
   struct CSUser {
     CSUser(Type* ETy, GlobalVariable *User, GlobalVariable *NewGV)
         : Ty(ETy), GV(User), DecGV(NewGV), DecStatus(nullptr),
-          InitFunc(nullptr) {}
+          InitFunc(nullptr), InitSlowFunc(nullptr) {}
     Type *Ty;
     GlobalVariable *GV;
     GlobalVariable *DecGV;
     GlobalVariable *DecStatus; // is decrypted or not
     Function *InitFunc; // InitFunc will use decryted string to initialize DecGV
+    Function *InitSlowFunc; // cold part of InitFunc doing the initialization
   };
 
   ObfuscationOptions *ArgsOptions;
@@ -81,6 +85,8 @@ struct StringEncryption : public ModulePass {
   void deleteUnusedGlobalVariable();
   static Function *buildDecryptFunction(Module *M, const CSPEntry *Entry);
   Function *buildInitFunction(Module *M, const CSUser *User);
+  static Function *buildStatusCheck(Function *SlowFunc, GlobalVariable *DecStatus,
+                                    const Twine &Name);
   void getRandomBytes(std::vector<uint8_t> &Bytes, uint32_t MinSize, uint32_t MaxSize);
   void lowerGlobalConstant(Constant *CV, IRBuilder<> &IRB, Value *Ptr, Type *Ty);
   void lowerGlobalConstantStruct(ConstantStruct *CS, IRBuilder<> &IRB, Value *Ptr, Type *Ty);
@@ -90,6 +96,9 @@ struct StringEncryption : public ModulePass {
 
 char StringEncryption::ID = 0;
 bool StringEncryption::runOnModule(Module &M) {
+  seedRandomEngine(RandomEngine, ArgsOptions,
+                   ArgsOptions->cseOpt()->attributeName(), M);
+
   std::set<GlobalVariable *> ConstantStringUsers;
 
   // collect all c strings
@@ -148,7 +157,9 @@ bool StringEncryption::runOnModule(Module &M) {
       }
       LastPlainChar = CurrentPlainChar;
     }
-    Entry->DecFunc = buildDecryptFunction(&M, Entry);
+    Entry->DecSlowFunc = buildDecryptFunction(&M, Entry);
+    Entry->DecFunc = buildStatusCheck(Entry->DecSlowFunc, Entry->DecStatus,
+                                      "goron_decrypt_string_" + Twine::utohexstr(Entry->ID));
   }
 
   // build initialization function for supported constant string users
@@ -163,7 +174,9 @@ bool StringEncryption::runOnModule(Module &M) {
           Zero, "dec_status_" + GV->getName());
       CSUser *User = new CSUser(EltType, GV, DecGV);
       User->DecStatus = DecStatus;
-      User->InitFunc = buildInitFunction(&M, User);
+      User->InitSlowFunc = buildInitFunction(&M, User);
+      User->InitFunc = buildStatusCheck(User->InitSlowFunc, DecStatus,
+                                        "__global_variable_initializer_" + GV->getName());
       CSUserMap[GV] = User;
     }
   }
@@ -197,7 +210,7 @@ bool StringEncryption::runOnModule(Module &M) {
 
   for (auto &I : CSUserMap) {
     CSUser *User = I.second;
-    Changed |= processConstantStringUse(User->InitFunc);
+    Changed |= processConstantStringUse(User->InitSlowFunc);
   }
 
   // delete unused global variables
@@ -205,6 +218,7 @@ bool StringEncryption::runOnModule(Module &M) {
   for (CSPEntry *Entry: ConstantStringPool) {
     if (Entry->DecFunc->use_empty()) {
       Entry->DecFunc->eraseFromParent();
+      Entry->DecSlowFunc->eraseFromParent();
     }
   }
   return Changed;
@@ -266,7 +280,7 @@ Function *StringEncryption::buildDecryptFunction(Module *M, const StringEncrypti
       {PointerType::getUnqual(Ctx), PointerType::getUnqual(Ctx)},
       false);
   Function *DecFunc =
-      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "goron_decrypt_string_" + Twine::utohexstr(Entry->ID), M);
+      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "goron_decrypt_string_slow_" + Twine::utohexstr(Entry->ID), M);
 
   auto ArgIt = DecFunc->arg_begin();
   Argument *PlainString = ArgIt; // output
@@ -289,10 +303,7 @@ Function *StringEncryption::buildDecryptFunction(Module *M, const StringEncrypti
   IRB.SetInsertPoint(Enter);
   ConstantInt *KeySize = ConstantInt::get(Type::getInt32Ty(Ctx), Entry->EncKey.size());
   Value *EncPtr = IRB.CreateInBoundsGEP(IRB.getInt8Ty(), Data, KeySize);
-  Value *DecStatus = IRB.CreateLoad(
-      Entry->DecStatus->getValueType(), Entry->DecStatus);
-  Value *IsDecrypted = IRB.CreateICmpEQ(DecStatus, IRB.getInt32(1));
-  IRB.CreateCondBr(IsDecrypted, Exit, LoopBody);
+  IRB.CreateBr(LoopBody);
 
   IRB.SetInsertPoint(LoopBody);
   PHINode *LoopCounter = IRB.CreatePHI(IRB.getInt32Ty(), 2);
@@ -365,7 +376,7 @@ Function *StringEncryption::buildInitFunction(Module *M, const StringEncryption:
   IRBuilder<> IRB(Ctx);
   FunctionType *FuncTy = FunctionType::get(Type::getVoidTy(Ctx), {User->DecGV->getType()}, false);
   Function *InitFunc =
-      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "__global_variable_initializer_" + User->GV->getName(), M);
+      Function::Create(FuncTy, GlobalValue::PrivateLinkage, "__global_variable_initializer_slow_" + User->GV->getName(), M);
 
   auto ArgIt = InitFunc->arg_begin();
   Argument *thiz = ArgIt;
@@ -374,25 +385,54 @@ Function *StringEncryption::buildInitFunction(Module *M, const StringEncryption:
   thiz->addAttr(Attribute::NoCapture);
 
   // convert constant initializer into a series of instructions
-  BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", InitFunc);
   BasicBlock *InitBlock = BasicBlock::Create(Ctx, "InitBlock", InitFunc);
-  BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", InitFunc);
-
-  IRB.SetInsertPoint(Enter);
-  Value *DecStatus = IRB.CreateLoad(
-      User->DecStatus->getValueType(), User->DecStatus);
-  Value *IsDecrypted = IRB.CreateICmpEQ(DecStatus, IRB.getInt32(1));
-  IRB.CreateCondBr(IsDecrypted, Exit, InitBlock);
 
   IRB.SetInsertPoint(InitBlock);
   Constant *Init = User->GV->getInitializer();
   lowerGlobalConstant(Init, IRB, User->DecGV, User->Ty);
   IRB.CreateStore(IRB.getInt32(1), User->DecStatus);
+  IRB.CreateRetVoid();
+
+  return InitFunc;
+}
+
+// Split the one-time work into a cold function that lives in .text.unlikely,
+// only the status check stays on the path of every string use.
+Function *StringEncryption::buildStatusCheck(Function *SlowFunc,
+                                             GlobalVariable *DecStatus,
+                                             const Twine &Name) {
+  SlowFunc->addFnAttr(Attribute::Cold);
+  SlowFunc->addFnAttr(Attribute::NoInline);
+  SlowFunc->setSectionPrefix("unlikely");
+
+  LLVMContext &Ctx = SlowFunc->getContext();
+  Function *Func = Function::Create(SlowFunc->getFunctionType(),
+                                    GlobalValue::PrivateLinkage, Name,
+                                    SlowFunc->getParent());
+  SmallVector<Value *, 2> Args;
+  for (unsigned i = 0; i < Func->arg_size(); ++i) {
+    Argument *Arg = Func->getArg(i);
+    Arg->setName(SlowFunc->getArg(i)->getName());
+    Arg->addAttr(Attribute::NoCapture);
+    Args.push_back(Arg);
+  }
+
+  BasicBlock *Enter = BasicBlock::Create(Ctx, "Enter", Func);
+  BasicBlock *Decrypt = BasicBlock::Create(Ctx, "Decrypt", Func);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "Exit", Func);
+
+  IRBuilder<> IRB(Enter);
+  Value *Status = IRB.CreateLoad(DecStatus->getValueType(), DecStatus);
+  Value *IsDecrypted = IRB.CreateICmpEQ(Status, IRB.getInt32(1));
+  setUnlikelySuccessor(IRB.CreateCondBr(IsDecrypted, Exit, Decrypt), 1);
+
+  IRB.SetInsertPoint(Decrypt);
+  IRB.CreateCall(SlowFunc, Args);
   IRB.CreateBr(Exit);
 
   IRB.SetInsertPoint(Exit);
   IRB.CreateRetVoid();
-  return InitFunc;
+  return Func;
 }
 
 void StringEncryption::lowerGlobalConstant(Constant *CV, IRBuilder<> &IRB, Value *Ptr, Type *Ty) {
@@ -436,6 +476,19 @@ bool StringEncryption::processConstantStringUse(Function *F) {
   LLVMContext &Ctx = F->getContext();
   LowerConstantExpr(*F);
   SmallPtrSet<GlobalVariable *, 16> DecryptedGV; // if GV has multiple use in a block, decrypt only at the first use
+  // The hottest blocks do not call the decryptor, their strings are
+  // decrypted once in the entry block instead
+  HotnessInfo Hotness(*F, /*SkipOnly=*/true);
+  SmallPtrSet<GlobalVariable *, 16> EntryDecryptedGV;
+  auto decryptPoint = [&](BasicBlock *UseBB, Instruction *Default) {
+    return Hotness.skip(UseBB) ? &*F->getEntryBlock().getFirstInsertionPt()
+                               : Default;
+  };
+  auto decrypted = [&](BasicBlock *UseBB) -> SmallPtrSetImpl<GlobalVariable *> & {
+    return Hotness.skip(UseBB) ? EntryDecryptedGV : DecryptedGV;
+  };
+  SmallPtrSet<GlobalVariable *, 16> EncryptedGV;
+  unsigned DecryptCalls = 0;
   bool Changed = false;
   for (BasicBlock &BB : *F) {
     DecryptedGV.clear();
@@ -447,23 +500,29 @@ bool StringEncryption::processConstantStringUse(Function *F) {
             auto Iter2 = CSUserMap.find(GV);
             if (Iter2 != CSUserMap.end()) { // GV is a constant string user
               CSUser *User = Iter2->second;
-              if (DecryptedGV.count(GV) > 0) {
+              if (DecryptedGV.count(GV) > 0 || EntryDecryptedGV.count(GV) > 0) {
                 Inst.replaceUsesOfWith(GV, User->DecGV);
               } else {
-                Instruction *InsertPoint = PHI->getIncomingBlock(i)->getTerminator();
+                BasicBlock *UseBB = PHI->getIncomingBlock(i);
+                Instruction *InsertPoint =
+                    decryptPoint(UseBB, UseBB->getTerminator());
                 IRBuilder<> IRB(InsertPoint);
                 fixEH(IRB.CreateCall(User->InitFunc, {User->DecGV}));
                 Inst.replaceUsesOfWith(GV, User->DecGV);
                 MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
+                decrypted(UseBB).insert(GV);
+                EncryptedGV.insert(GV);
+                ++DecryptCalls;
                 Changed = true;
               }
             } else if (Iter1 != CSPEntryMap.end()) { // GV is a constant string
               CSPEntry *Entry = Iter1->second;
-              if (DecryptedGV.count(GV) > 0) {
+              if (DecryptedGV.count(GV) > 0 || EntryDecryptedGV.count(GV) > 0) {
                 Inst.replaceUsesOfWith(GV, Entry->DecGV);
               } else {
-                Instruction *InsertPoint = PHI->getIncomingBlock(i)->getTerminator();
+                BasicBlock *UseBB = PHI->getIncomingBlock(i);
+                Instruction *InsertPoint =
+                    decryptPoint(UseBB, UseBB->getTerminator());
                 IRBuilder<> IRB(InsertPoint);
 
                 Value *OutBuf = IRB.CreateBitCast(Entry->DecGV,
@@ -476,7 +535,9 @@ bool StringEncryption::processConstantStringUse(Function *F) {
 
                 Inst.replaceUsesOfWith(GV, Entry->DecGV);
                 MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
+                decrypted(UseBB).insert(GV);
+                EncryptedGV.insert(GV);
+                ++DecryptCalls;
                 Changed = true;
               }
             }
@@ -489,22 +550,26 @@ bool StringEncryption::processConstantStringUse(Function *F) {
             auto Iter2 = CSUserMap.find(GV);
             if (Iter2 != CSUserMap.end()) {
               CSUser *User = Iter2->second;
-              if (DecryptedGV.count(GV) > 0) {
+              if (DecryptedGV.count(GV) > 0 || EntryDecryptedGV.count(GV) > 0) {
                 Inst.replaceUsesOfWith(GV, User->DecGV);
               } else {
-                IRBuilder<> IRB(&Inst);
+                BasicBlock *UseBB = &BB;
+                IRBuilder<> IRB(decryptPoint(UseBB, &Inst));
                 fixEH(IRB.CreateCall(User->InitFunc, {User->DecGV}));
                 Inst.replaceUsesOfWith(GV, User->DecGV);
                 MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
+                decrypted(UseBB).insert(GV);
+                EncryptedGV.insert(GV);
+                ++DecryptCalls;
                 Changed = true;
               }
             } else if (Iter1 != CSPEntryMap.end()) {
               CSPEntry *Entry = Iter1->second;
-              if (DecryptedGV.count(GV) > 0) {
+              if (DecryptedGV.count(GV) > 0 || EntryDecryptedGV.count(GV) > 0) {
                 Inst.replaceUsesOfWith(GV, Entry->DecGV);
               } else {
-                IRBuilder<> IRB(&Inst);
+                BasicBlock *UseBB = &BB;
+                IRBuilder<> IRB(decryptPoint(UseBB, &Inst));
                 
                 Value *OutBuf = IRB.CreateBitCast(Entry->DecGV,
                                                   PointerType::getUnqual(Ctx));
@@ -516,7 +581,9 @@ bool StringEncryption::processConstantStringUse(Function *F) {
 
                 Inst.replaceUsesOfWith(GV, Entry->DecGV);
                 MaybeDeadGlobalVars.insert(GV);
-                DecryptedGV.insert(GV);
+                decrypted(UseBB).insert(GV);
+                EncryptedGV.insert(GV);
+                ++DecryptCalls;
                 Changed = true;
               }
             }
@@ -525,6 +592,15 @@ bool StringEncryption::processConstantStringUse(Function *F) {
       }
     }
   }
+
+  if (Changed && obfuscationRemarksEnabled(*F)) {
+    using NV = DiagnosticInfoOptimizationBase::Argument;
+    OptimizationRemark Remark(DEBUG_TYPE, "StringEncryption", F);
+    Remark << "StringEncryption: "
+           << NV("StringsEncrypted", EncryptedGV.size()) << " strings decrypted by "
+           << NV("DecryptorCalls", DecryptCalls) << " decryptor calls";
+    Ctx.diagnose(Remark);
+  }
   return Changed;
 }
 
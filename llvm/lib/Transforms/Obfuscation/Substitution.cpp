@@ -1,24 +1,25 @@
 #include "llvm/Transforms/Obfuscation/Substitution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/NoFolder.h"
 #include "llvm/Transforms/Obfuscation/CryptoUtils.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Obfuscation/Hotness.h"
 #include "llvm/Transforms/Obfuscation/Utils.h"
 
+#include <optional>
+
 using namespace llvm;
 
 
 #define DEBUG_TYPE "sub"
 
 
-#define NUMBER_ADD_SUBST 4
-#define NUMBER_SUB_SUBST 3
-#define NUMBER_AND_SUBST 2
-#define NUMBER_OR_SUBST 2
-#define NUMBER_XOR_SUBST 2
-
-
 // Stats
 STATISTIC(Add, "Add substitued");
 STATISTIC(Sub, "Sub substitued");
@@ -29,38 +30,90 @@ STATISTIC(Sub, "Sub substitued");
 STATISTIC(And, "And substitued");
 STATISTIC(Or, "Or substitued");
 STATISTIC(Xor, "Xor substitued");
+STATISTIC(SubInstsBefore, "Instructions before substitution");
+STATISTIC(SubInstsAfter, "Instructions after substitution");
+
+static cl::opt<unsigned>
+    MaxGrowth("irobf-sub-max-growth", cl::init(8), cl::NotHidden,
+              cl::desc("Maximum factor a function may grow by during "
+                       "substitution"),
+              cl::ZeroOrMore);
+
+static cl::opt<unsigned> HotCostSlack(
+    "irobf-sub-hot-slack", cl::init(25), cl::NotHidden,
+    cl::desc("Percentage above the cheapest rewrite still accepted in hot "
+             "blocks"),
+    cl::ZeroOrMore);
 
 
 struct Substitution : FunctionPass {
   static char ID;
   ObfuscationOptions *ArgsOptions;
-
-  void (Substitution::*funcAdd[NUMBER_ADD_SUBST])(BinaryOperator *bo);
-  void (Substitution::*funcSub[NUMBER_SUB_SUBST])(BinaryOperator *bo);
-  void (Substitution::*funcAnd[NUMBER_AND_SUBST])(BinaryOperator *bo);
-  void (Substitution::*funcOr[NUMBER_OR_SUBST])(BinaryOperator *bo);
-  void (Substitution::*funcXor[NUMBER_XOR_SUBST])(BinaryOperator *bo);
+  CryptoUtils RandomEngine;
+
+  struct Rewrite {
+    unsigned                    Opcode;
+    void (Substitution::*Apply)(BinaryOperator *bo);
+    // Opcodes of the emitted instructions and the length of the longest
+    // dependency chain among them, used to estimate the cost per target.
+    SmallVector<unsigned, 8>    Ops;
+    unsigned                    Depth;
+  };
+
+  struct RewriteCost {
+    uint64_t Throughput;
+    uint64_t Latency;
+  };
+
+  std::vector<Rewrite> Catalogue;
+  DenseMap<std::pair<Type *, unsigned>, RewriteCost> CostCache;
+  const TargetTransformInfo *TTI = nullptr;
 
   Substitution(ObfuscationOptions *argsOptions) : FunctionPass(ID) {
     this->ArgsOptions = argsOptions;
 
-    funcAdd[0] = &Substitution::addNeg;
-    funcAdd[1] = &Substitution::addDoubleNeg;
-    funcAdd[2] = &Substitution::addRand;
-    funcAdd[3] = &Substitution::addRand2;
-
-    funcSub[0] = &Substitution::subNeg;
-    funcSub[1] = &Substitution::subRand;
-    funcSub[2] = &Substitution::subRand2;
-
-    funcAnd[0] = &Substitution::andSubstitution;
-    funcAnd[1] = &Substitution::andSubstitutionRand;
-
-    funcOr[0] = &Substitution::orSubstitution;
-    funcOr[1] = &Substitution::orSubstitutionRand;
-
-    funcXor[0] = &Substitution::xorSubstitution;
-    funcXor[1] = &Substitution::xorSubstitutionRand;
+    using I = Instruction;
+    Catalogue = {
+        {I::Add, &Substitution::addNeg, {I::Sub, I::Sub}, 2},
+        {I::Add, &Substitution::addDoubleNeg, {I::Sub, I::Sub, I::Add, I::Sub}, 3},
+        {I::Add, &Substitution::addRand, {I::Add, I::Add, I::Sub}, 3},
+        {I::Add, &Substitution::addRand2, {I::Sub, I::Add, I::Add}, 3},
+        {I::Add, &Substitution::addXorAnd, {I::Xor, I::And, I::Add, I::Add}, 3},
+        {I::Add, &Substitution::addOrAnd, {I::Or, I::And, I::Add}, 2},
+        {I::Add, &Substitution::addOrXor, {I::Or, I::Add, I::Xor, I::Sub}, 3},
+
+        {I::Sub, &Substitution::subNeg, {I::Sub, I::Add}, 2},
+        {I::Sub, &Substitution::subRand, {I::Add, I::Sub, I::Sub}, 3},
+        {I::Sub, &Substitution::subRand2, {I::Sub, I::Sub, I::Add}, 3},
+        {I::Sub, &Substitution::subXorAndNot,
+         {I::Xor, I::Xor, I::And, I::Add, I::Sub}, 4},
+        {I::Sub, &Substitution::subAndNotDiff,
+         {I::Xor, I::And, I::Xor, I::And, I::Sub}, 3},
+        {I::Sub, &Substitution::subAndNotXor,
+         {I::Xor, I::And, I::Add, I::Xor, I::Sub}, 4},
+
+        {I::And, &Substitution::andSubstitution, {I::Xor, I::Xor, I::And}, 3},
+        {I::And, &Substitution::andSubstitutionRand,
+         {I::Xor, I::Xor, I::Xor, I::Or, I::Or, I::Xor, I::And}, 3},
+        {I::And, &Substitution::andAddOr, {I::Add, I::Or, I::Sub}, 2},
+        {I::And, &Substitution::andNotOr, {I::Xor, I::Or, I::Sub}, 3},
+
+        {I::Or, &Substitution::orSubstitution, {I::And, I::Xor, I::Or}, 2},
+        {I::Or, &Substitution::orSubstitutionRand,
+         {I::Xor, I::Xor, I::Xor, I::And, I::And, I::And, I::And, I::Or,
+          I::Or, I::Xor, I::Or, I::Xor, I::Or, I::And, I::Or}, 5},
+        {I::Or, &Substitution::orAddAnd, {I::Add, I::And, I::Sub}, 2},
+        {I::Or, &Substitution::orXorAnd, {I::Xor, I::And, I::Add}, 2},
+        {I::Or, &Substitution::orAndNotAdd, {I::Xor, I::And, I::Add}, 3},
+
+        {I::Xor, &Substitution::xorSubstitution,
+         {I::Xor, I::And, I::Xor, I::And, I::Or}, 3},
+        {I::Xor, &Substitution::xorSubstitutionRand,
+         {I::Xor, I::And, I::Xor, I::And, I::Xor, I::And, I::And, I::Or,
+          I::Or, I::Xor}, 5},
+        {I::Xor, &Substitution::xorOrAnd, {I::Or, I::And, I::Sub}, 2},
+        {I::Xor, &Substitution::xorAddAnd, {I::Add, I::And, I::Add, I::Sub}, 3},
+    };
   }
 
   StringRef getPassName() const override { return {"Substitution"}; }
@@ -70,88 +123,316 @@ struct Substitution : FunctionPass {
     if (!opt.isEnabled()) {
       return false;
     }
-    return substitute(&F, opt.level());
+    seedRandomEngine(RandomEngine, ArgsOptions, opt.attributeName(),
+                     *F.getParent(), &F);
+
+    // Without a TTI from the pass manager fall back to the target
+    // independent cost model
+    std::optional<TargetTransformInfo> DefaultTTI;
+    TTI = ArgsOptions->getTTI(F);
+    if (!TTI) {
+      DefaultTTI.emplace(F.getParent()->getDataLayout());
+      TTI = &*DefaultTTI;
+    }
+    CostCache.clear();
+
+    bool Changed = substitute(&F, opt.level());
+    TTI = nullptr;
+    return Changed;
+  }
+
+  static bool isSubstitutable(Instruction &I) {
+    if (!I.getType()->isIntOrIntVectorTy()) {
+      return false;
+    }
+    switch (I.getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return true;
+    default:
+      return false;
+    }
   }
 
+  // Only the original instructions are substituted first, the instructions
+  // created for them are substituted again at the next depth, up to
+  // 1 + level depths and as long as the function stays within its growth
+  // budget.
   bool substitute(Function *f, uint32_t obfAddition) {
-    Function *tmp = f;
+    unsigned maxDepth = 1 + obfAddition;
+    uint64_t origSize = f->getInstructionCount();
+    uint64_t budget = origSize * (std::max(MaxGrowth.getValue(), 1u) - 1);
+    uint64_t added = 0;
+
+    // Hot blocks get the cheap rewrites, see pickRewrite
+    HotnessInfo Hotness(*f);
+    if (Hotness.skipFunction()) {
+      return false;
+    }
+
+    std::vector<BinaryOperator *> worklist, next;
+    for (BasicBlock &BB : *f) {
+      if (Hotness.skip(&BB)) {
+        continue;
+      }
+      for (Instruction &I : BB) {
+        if (isSubstitutable(I)) {
+          worklist.push_back(cast<BinaryOperator>(&I));
+        }
+      }
+    }
 
-    // Loop for the number of time we run the pass on the function
-    int times = 1 + obfAddition;
     bool checkChanged = false;
-    do {
-      for (Function::iterator bb = tmp->begin(); bb != tmp->end(); ++bb) {
-        for (BasicBlock::iterator inst = bb->begin(); inst != bb->end();
-             ++inst) {
-          if (inst->isBinaryOp()) {
-            switch (inst->getOpcode()) {
-            case BinaryOperator::Add:
-              // case BinaryOperator::FAdd:
-              // Substitute with random add operation
-              (this->*funcAdd[llvm::cryptoutils->get_range(NUMBER_ADD_SUBST)])(
-                  cast<BinaryOperator>(inst));
-              ++Add;
-              checkChanged = true;
-              break;
-            case BinaryOperator::Sub:
-              // case BinaryOperator::FSub:
-              // Substitute with random sub operation
-              (this->*funcSub[llvm::cryptoutils->get_range(NUMBER_SUB_SUBST)])(
-                  cast<BinaryOperator>(inst));
-              ++Sub;
-              checkChanged = true;
-              break;
-            case BinaryOperator::Mul:
-            case BinaryOperator::FMul:
-              //++Mul;
-              break;
-            case BinaryOperator::UDiv:
-            case BinaryOperator::SDiv:
-            case BinaryOperator::FDiv:
-              //++Div;
-              break;
-            case BinaryOperator::URem:
-            case BinaryOperator::SRem:
-            case BinaryOperator::FRem:
-              //++Rem;
-              break;
-            case Instruction::Shl:
-              //++Shi;
-              break;
-            case Instruction::LShr:
-              //++Shi;
-              break;
-            case Instruction::AShr:
-              //++Shi;
-              break;
-            case Instruction::And:
-              (this->*funcAnd[llvm::cryptoutils->get_range(2)])(
-                  cast<BinaryOperator>(inst));
-              ++And;
-              checkChanged = true;
-              break;
-            case Instruction::Or:
-              (this->*funcOr[llvm::cryptoutils->get_range(2)])(
-                  cast<BinaryOperator>(inst));
-              ++Or;
-              checkChanged = true;
-              break;
-            case Instruction::Xor:
-              (this->*funcXor[llvm::cryptoutils->get_range(2)])(
-                  cast<BinaryOperator>(inst));
-              ++Xor;
-              checkChanged = true;
-              break;
-            default:
-              break;
-            } // End switch
-          } // End isBinaryOp
-        } // End for basickblock
-      } // End for Function
-    } while (--times > 0); // for times
+    for (unsigned depth = 0; depth < maxDepth && !worklist.empty(); ++depth) {
+      next.clear();
+      for (BinaryOperator *bo : worklist) {
+        if (added >= budget) {
+          break;
+        }
+        Instruction *prev = bo->getPrevNode();
+        substituteOne(bo, Hotness.isHot(bo->getParent()));
+
+        // Everything between prev and bo was created by the rewrite
+        Instruction *I = prev ? prev->getNextNode() : &bo->getParent()->front();
+        for (; I != bo; I = I->getNextNode()) {
+          ++added;
+          if (isSubstitutable(*I)) {
+            next.push_back(cast<BinaryOperator>(I));
+          }
+        }
+        bo->eraseFromParent();
+        --added;
+        checkChanged = true;
+      }
+      worklist.swap(next);
+    }
+
+    SubInstsBefore += origSize;
+    SubInstsAfter += origSize + added;
+    LLVM_DEBUG(dbgs() << "sub: " << f->getName() << " expanded by "
+                      << format("%.2f", origSize ? (double)(origSize + added) /
+                                                       origSize
+                                                 : 1.0)
+                      << "x (" << origSize << " -> " << origSize + added
+                      << " instructions)\n");
     return checkChanged;
   }
 
+  static uint64_t costValue(InstructionCost C) {
+    return C.isValid() ? (uint64_t)*C.getValue() : 1;
+  }
+
+  const RewriteCost &getCost(Type *ty, unsigned index) {
+    auto It = CostCache.find({ty, index});
+    if (It != CostCache.end()) {
+      return It->second;
+    }
+    const Rewrite &R = Catalogue[index];
+    uint64_t throughput = 0, latency = 0;
+    for (unsigned op : R.Ops) {
+      throughput += costValue(TTI->getArithmeticInstrCost(
+          op, ty, TargetTransformInfo::TCK_RecipThroughput));
+      latency = std::max(latency, costValue(TTI->getArithmeticInstrCost(
+                                      op, ty, TargetTransformInfo::TCK_Latency)));
+    }
+    // The critical path is approximated by the depth times the slowest op
+    return CostCache[{ty, index}] = {throughput, latency * R.Depth};
+  }
+
+  // Cold code picks uniformly from the whole catalogue. Hot code only
+  // considers the rewrites whose critical path and throughput cost are
+  // within the slack of the cheapest one for this type on this target.
+  const Rewrite *pickRewrite(BinaryOperator *bo, bool hot) {
+    SmallVector<unsigned, 8> candidates;
+    for (unsigned i = 0; i < Catalogue.size(); ++i) {
+      if (Catalogue[i].Opcode == bo->getOpcode()) {
+        candidates.push_back(i);
+      }
+    }
+    if (candidates.empty()) {
+      return nullptr;
+    }
+
+    if (hot) {
+      Type *ty = bo->getType();
+      auto score = [&](unsigned i) {
+        const RewriteCost &C = getCost(ty, i);
+        return C.Latency * 4 + C.Throughput;
+      };
+      uint64_t best = UINT64_MAX;
+      for (unsigned i : candidates) {
+        best = std::min(best, score(i));
+      }
+      uint64_t limit = best + best * HotCostSlack / 100;
+      llvm::erase_if(candidates, [&](unsigned i) { return score(i) > limit; });
+    }
+    return &Catalogue[candidates[RandomEngine.get_range(
+        candidates.size())]];
+  }
+
+  void substituteOne(BinaryOperator *bo, bool hot) {
+    const Rewrite *R = pickRewrite(bo, hot);
+    if (!R) {
+      return;
+    }
+    (this->*R->Apply)(bo);
+    switch (bo->getOpcode()) {
+    case Instruction::Add:
+      ++Add;
+      break;
+    case Instruction::Sub:
+      ++Sub;
+      break;
+    case Instruction::And:
+      ++And;
+      break;
+    case Instruction::Or:
+      ++Or;
+      break;
+    case Instruction::Xor:
+      ++Xor;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Random constant of the operand type, vectors get a different value per
+  // lane so the rewrite stays a vector operation
+  Constant *getRandomConstant(Type *ty) {
+    if (auto *VT = dyn_cast<FixedVectorType>(ty)) {
+      SmallVector<Constant *, 16> lanes;
+      for (unsigned i = 0; i < VT->getNumElements(); ++i) {
+        lanes.push_back(ConstantInt::get(VT->getElementType(),
+                                         RandomEngine.get_uint64_t()));
+      }
+      return ConstantVector::get(lanes);
+    }
+    return ConstantInt::get(ty, RandomEngine.get_uint64_t());
+  }
+
+  // x + x, unlike x << 1 it is also defined for i1 where the shift amount
+  // equals the bit width
+  static Value *createDouble(IRBuilder<NoFolder> &IRB, Value *v) {
+    return IRB.CreateAdd(v, v);
+  }
+
+  // Implementation of a = (b ^ c) + 2 * (b & c)
+  void addXorAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateAdd(IRB.CreateXor(x, y),
+                              createDouble(IRB, IRB.CreateAnd(x, y)));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b | c) + (b & c)
+  void addOrAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateAdd(IRB.CreateOr(x, y), IRB.CreateAnd(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = 2 * (b | c) - (b ^ c)
+  void addOrXor(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(createDouble(IRB, IRB.CreateOr(x, y)),
+                              IRB.CreateXor(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b ^ c) - 2 * (~b & c)
+  void subXorAndNot(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(
+        IRB.CreateXor(x, y),
+        createDouble(IRB, IRB.CreateAnd(IRB.CreateNot(x), y)));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b & ~c) - (~b & c)
+  void subAndNotDiff(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(IRB.CreateAnd(x, IRB.CreateNot(y)),
+                              IRB.CreateAnd(IRB.CreateNot(x), y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = 2 * (b & ~c) - (b ^ c)
+  void subAndNotXor(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(
+        createDouble(IRB, IRB.CreateAnd(x, IRB.CreateNot(y))),
+        IRB.CreateXor(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b + c) - (b | c)
+  void andAddOr(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(IRB.CreateAdd(x, y), IRB.CreateOr(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (~b | c) - ~b
+  void andNotOr(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *notX = IRB.CreateNot(x);
+    Value *op = IRB.CreateSub(IRB.CreateOr(notX, y), notX);
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b + c) - (b & c)
+  void orAddAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(IRB.CreateAdd(x, y), IRB.CreateAnd(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b ^ c) + (b & c)
+  void orXorAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateAdd(IRB.CreateXor(x, y), IRB.CreateAnd(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b & ~c) + c
+  void orAndNotAdd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateAdd(IRB.CreateAnd(x, IRB.CreateNot(y)), y);
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b | c) - (b & c)
+  void xorOrAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(IRB.CreateOr(x, y), IRB.CreateAnd(x, y));
+    bo->replaceAllUsesWith(op);
+  }
+
+  // Implementation of a = (b + c) - 2 * (b & c)
+  void xorAddAnd(BinaryOperator *bo) {
+    IRBuilder<NoFolder> IRB(bo);
+    Value *x = bo->getOperand(0), *y = bo->getOperand(1);
+    Value *op = IRB.CreateSub(IRB.CreateAdd(x, y),
+                              createDouble(IRB, IRB.CreateAnd(x, y)));
+    bo->replaceAllUsesWith(op);
+  }
+
   // Implementation of a = b - (-c)
   void addNeg(BinaryOperator *bo) {
     BinaryOperator *op = NULL;
@@ -202,8 +483,7 @@ struct Substitution : FunctionPass {
 
     if (bo->getOpcode() == Instruction::Add) {
       Type *ty = bo->getType();
-      ConstantInt *co = (ConstantInt *)ConstantInt::get(
-          ty, llvm::cryptoutils->get_uint64_t());
+      Constant *co = getRandomConstant(ty);
       op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "",
                                   bo);
       op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "",
@@ -219,7 +499,7 @@ struct Substitution : FunctionPass {
     /* else {
         Type *ty = bo->getType();
         ConstantFP *co =
-    (ConstantFP*)ConstantFP::get(ty,(float)llvm::cryptoutils->get_uint64_t());
+    (ConstantFP*)ConstantFP::get(ty,(float)RandomEngine.get_uint64_t());
         op =
     BinaryOperator::Create(Instruction::FAdd,bo->getOperand(0),co,"",bo); op =
     BinaryOperator::Create(Instruction::FAdd,op,bo->getOperand(1),"",bo); op =
@@ -233,8 +513,7 @@ struct Substitution : FunctionPass {
 
     if (bo->getOpcode() == Instruction::Add) {
       Type *ty = bo->getType();
-      ConstantInt *co = (ConstantInt *)ConstantInt::get(
-          ty, llvm::cryptoutils->get_uint64_t());
+      Constant *co = getRandomConstant(ty);
       op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "",
                                   bo);
       op = BinaryOperator::Create(Instruction::Add, op, bo->getOperand(1), "",
@@ -250,7 +529,7 @@ struct Substitution : FunctionPass {
     /* else {
         Type *ty = bo->getType();
         ConstantFP *co =
-    (ConstantFP*)ConstantFP::get(ty,(float)llvm::cryptoutils->get_uint64_t());
+    (ConstantFP*)ConstantFP::get(ty,(float)RandomEngine.get_uint64_t());
         op =
     BinaryOperator::Create(Instruction::FAdd,bo->getOperand(0),co,"",bo); op =
     BinaryOperator::Create(Instruction::FAdd,op,bo->getOperand(1),"",bo); op =
@@ -282,8 +561,7 @@ struct Substitution : FunctionPass {
 
     if (bo->getOpcode() == Instruction::Sub) {
       Type *ty = bo->getType();
-      ConstantInt *co = (ConstantInt *)ConstantInt::get(
-          ty, llvm::cryptoutils->get_uint64_t());
+      Constant *co = getRandomConstant(ty);
       op = BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "",
                                   bo);
       op = BinaryOperator::Create(Instruction::Sub, op, bo->getOperand(1), "",
@@ -299,7 +577,7 @@ struct Substitution : FunctionPass {
     /* else {
         Type *ty = bo->getType();
         ConstantFP *co =
-    (ConstantFP*)ConstantFP::get(ty,(float)llvm::cryptoutils->get_uint64_t());
+    (ConstantFP*)ConstantFP::get(ty,(float)RandomEngine.get_uint64_t());
         op =
     BinaryOperator::Create(Instruction::FAdd,bo->getOperand(0),co,"",bo); op =
     BinaryOperator::Create(Instruction::FSub,op,bo->getOperand(1),"",bo); op =
@@ -313,8 +591,7 @@ struct Substitution : FunctionPass {
 
     if (bo->getOpcode() == Instruction::Sub) {
       Type *ty = bo->getType();
-      ConstantInt *co = (ConstantInt *)ConstantInt::get(
-          ty, llvm::cryptoutils->get_uint64_t());
+      Constant *co = getRandomConstant(ty);
       op = BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "",
                                   bo);
       op = BinaryOperator::Create(Instruction::Sub, op, bo->getOperand(1), "",
@@ -330,7 +607,7 @@ struct Substitution : FunctionPass {
     /* else {
         Type *ty = bo->getType();
         ConstantFP *co =
-    (ConstantFP*)ConstantFP::get(ty,(float)llvm::cryptoutils->get_uint64_t());
+    (ConstantFP*)ConstantFP::get(ty,(float)RandomEngine.get_uint64_t());
         op =
     BinaryOperator::Create(Instruction::FSub,bo->getOperand(0),co,"",bo); op =
     BinaryOperator::Create(Instruction::FSub,op,bo->getOperand(1),"",bo); op =
@@ -362,8 +639,7 @@ struct Substitution : FunctionPass {
     Type *ty = bo->getType();
 
     // r (Random number)
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = getRandomConstant(ty);
 
     // ~a
     BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -397,8 +673,7 @@ struct Substitution : FunctionPass {
   void orSubstitutionRand(BinaryOperator *bo) {
 
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = getRandomConstant(ty);
 
     // ~a
     BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -500,8 +775,7 @@ struct Substitution : FunctionPass {
     BinaryOperator *op = NULL;
 
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = getRandomConstant(ty);
 
     // ~a
     op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -2,10 +2,14 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/EHPersonalities.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Transforms/Obfuscation/CryptoUtils.h"
+#include "llvm/Transforms/Obfuscation/ObfuscationOptions.h"
 #include <random>
 
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
@@ -178,9 +182,252 @@ bool expandConstantExpr(Function &F) {
   return Changed;
 }
 
+void setScaledBranchWeights(Instruction *I, ArrayRef<uint64_t> Weights) {
+  uint64_t Max = 0;
+  for (uint64_t W : Weights)
+    Max = std::max(Max, W);
+  // Scale down so the largest weight fits in 32 bits
+  uint64_t Scale = Max / UINT32_MAX + 1;
+
+  SmallVector<uint32_t, 16> Scaled;
+  for (uint64_t W : Weights)
+    Scaled.push_back(W / Scale);
+  I->setMetadata(LLVMContext::MD_prof,
+                 MDBuilder(I->getContext()).createBranchWeights(Scaled));
+}
+
+void setUnlikelySuccessor(Instruction *Term, unsigned Succ) {
+  SmallVector<uint64_t, 16> Weights(Term->getNumSuccessors(), (1 << 20) - 1);
+  Weights[Succ] = 1;
+  setScaledBranchWeights(Term, Weights);
+}
+
+bool canUseRelativeTable(ArrayRef<Constant *> Targets) {
+  for (Constant *C : Targets) {
+    if (isa<BlockAddress>(C))
+      continue;
+    // A PC-relative reference to a preemptible symbol cannot be resolved at
+    // link time, those still need an absolute table
+    auto *GV = dyn_cast<GlobalValue>(C);
+    if (!GV || !GV->isDSOLocal() || GV->isThreadLocal() ||
+        GV->hasDLLImportStorageClass())
+      return false;
+  }
+  return true;
+}
+
+GlobalVariable *createTargetTable(Module &M, ArrayRef<Constant *> Targets,
+                                  ArrayRef<Constant *> Keys, bool Relative,
+                                  const Twine &Name) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I8Ty = Type::getInt8Ty(Ctx);
+  Type *PtrTy = PointerType::getUnqual(Ctx);
+
+  if (!Relative) {
+    std::vector<Constant *> Elements;
+    for (unsigned I = 0; I < Targets.size(); ++I) {
+      Constant *CE = ConstantExpr::getBitCast(Targets[I], PtrTy);
+      Elements.push_back(ConstantExpr::getGetElementPtr(I8Ty, CE, Keys[I]));
+    }
+    ArrayType *ATy = ArrayType::get(PtrTy, Elements.size());
+    return new GlobalVariable(M, ATy, false, GlobalValue::PrivateLinkage,
+                              ConstantArray::get(ATy, Elements), Name);
+  }
+
+  // The entries refer to the table itself, so create it before the
+  // initializer
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  Type *IntPtrTy = M.getDataLayout().getIntPtrType(Ctx);
+  ArrayType *ATy = ArrayType::get(I32Ty, Targets.size());
+  auto *GV = new GlobalVariable(M, ATy, true, GlobalValue::PrivateLinkage,
+                                nullptr, Name);
+  GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  GV->setAlignment(Align(4));
+
+  Constant *Base = ConstantExpr::getPtrToInt(GV, IntPtrTy);
+  std::vector<Constant *> Elements;
+  for (unsigned I = 0; I < Targets.size(); ++I) {
+    // entry = target + key - table. The decoded key is -key modulo 2^32 and
+    // loadTargetAddress only adds it sign extended from 30 bits, fold in the
+    // matching value. The addend stays in [-2^30, 2^30] so the PC32/PREL32
+    // value fits in signed 32 bits while target and table are within 1GB
+    uint32_t Dec = 0u - (uint32_t)cast<ConstantInt>(Keys[I])->getZExtValue();
+    int64_t Key = -SignExtend64<30>(Dec);
+    Constant *CE = ConstantExpr::getBitCast(Targets[I], PtrTy);
+    CE = ConstantExpr::getGetElementPtr(I8Ty, CE,
+                                        ConstantInt::get(IntPtrTy, Key, true));
+    CE = ConstantExpr::getSub(ConstantExpr::getPtrToInt(CE, IntPtrTy), Base);
+    Elements.push_back(ConstantExpr::getTrunc(CE, I32Ty));
+  }
+  GV->setInitializer(ConstantArray::get(ATy, Elements));
+  return GV;
+}
+
+Value *loadTargetAddress(IRBuilderBase &IRB, GlobalVariable *Table,
+                         Value *Idx, Value *DecKey, bool Relative,
+                         const Twine &Name) {
+  Type *I8Ty = IRB.getInt8Ty();
+  Value *GEP = IRB.CreateGEP(Table->getValueType(), Table,
+                             {ConstantInt::get(Idx->getType(), 0), Idx});
+  if (!Relative) {
+    Value *Enc = IRB.CreateLoad(IRB.getPtrTy(), GEP, Name);
+    return IRB.CreateGEP(I8Ty, Enc, DecKey);
+  }
+  // Only the low 30 bits of the key are used, see createTargetTable. 32 bit
+  // wrapping add, the GEP sign extends the result
+  DecKey = IRB.CreateAShr(IRB.CreateShl(DecKey, 2), 2);
+  Value *Off = IRB.CreateLoad(IRB.getInt32Ty(), GEP, Name);
+  Off = IRB.CreateAdd(Off, DecKey);
+  return IRB.CreateGEP(I8Ty, Table, Off);
+}
+
+IndirectKeyDecoder::IndirectKeyDecoder(Function &F, IntegerType *IntTy,
+                                       ConstantInt *EncKey,
+                                       ConstantInt *EncKey1,
+                                       GlobalVariable *GXorKey,
+                                       GlobalVariable *XorKeys, unsigned Level,
+                                       bool Hoist)
+    : F(F), IntTy(IntTy), EncKey(EncKey), EncKey1(EncKey1), GXorKey(GXorKey),
+      XorKeys(XorKeys), Level(Level), Hoist(Hoist) {}
+
+IRBuilder<> IndirectKeyDecoder::getEntryBuilder() {
+  // Hoisted code is kept in order right after the allocas, each new piece
+  // goes after the previous one since it may use it
+  if (LastHoisted)
+    return IRBuilder<>(LastHoisted->getParent(),
+                       std::next(LastHoisted->getIterator()));
+  BasicBlock &Entry = F.getEntryBlock();
+  BasicBlock::iterator IP = Entry.getFirstInsertionPt();
+  while (isa<AllocaInst>(*IP))
+    ++IP;
+  return IRBuilder<>(&Entry, IP);
+}
+
+void IndirectKeyDecoder::updateLastHoisted(IRBuilder<> &IRB) {
+  BasicBlock::iterator IP = IRB.GetInsertPoint();
+  if (IP != IRB.GetInsertBlock()->begin())
+    LastHoisted = &*std::prev(IP);
+}
+
+Value *IndirectKeyDecoder::loadXorKey(IRBuilder<> &IRB) {
+  ++LoadsEmitted;
+  if (!Hoist)
+    return IRB.CreateLoad(GXorKey->getValueType(), GXorKey);
+  if (!HoistedXorKey) {
+    IRBuilder<> EntryIRB = getEntryBuilder();
+    HoistedXorKey = EntryIRB.CreateLoad(GXorKey->getValueType(), GXorKey);
+    updateLastHoisted(EntryIRB);
+  } else {
+    --LoadsEmitted;
+  }
+  return HoistedXorKey;
+}
+
+Value *IndirectKeyDecoder::build(IRBuilder<> &IRB, Value *Idx,
+                                 Value *XorKey) {
+  // -EncKey = X - FuncSecret
+  Value *DecKey = EncKey;
+
+  if (GXorKey) {
+    if (Level == 1) {
+      DecKey = IRB.CreateXor(EncKey1, XorKey);
+      DecKey = IRB.CreateNeg(DecKey);
+    } else if (Level == 2) {
+      DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
+      DecKey = IRB.CreateNeg(DecKey);
+    }
+  }
+
+  if (XorKeys) {
+    Value *Zero = ConstantInt::get(IntTy, 0);
+    Value *XorKeysGEP =
+        IRB.CreateGEP(XorKeys->getValueType(), XorKeys, {Zero, Idx});
+
+    Value *XorKey = IRB.CreateLoad(IntTy, XorKeysGEP);
+    ++LoadsEmitted;
+
+    XorKey = IRB.CreateNeg(XorKey);
+    XorKey = IRB.CreateXor(XorKey, EncKey1);
+    XorKey = IRB.CreateNeg(XorKey);
+
+    DecKey = IRB.CreateXor(EncKey1, IRB.CreateMul(XorKey, Idx));
+    DecKey = IRB.CreateNeg(DecKey);
+  }
+  return DecKey;
+}
+
+Value *IndirectKeyDecoder::get(IRBuilder<> &IRB, Value *Idx) {
+  if (!GXorKey && !XorKeys)
+    return EncKey;
+  LoadsRequested += (GXorKey ? 1 : 0) + (XorKeys ? 1 : 0);
+
+  // Level 1 does not depend on the index, the others can only be cached
+  // for a constant one
+  auto *CIdx = dyn_cast<ConstantInt>(Idx);
+  bool IndexFree = GXorKey && Level == 1;
+  auto *SI = dyn_cast<SelectInst>(Idx);
+  if (Hoist && !CIdx && !IndexFree && SI &&
+      isa<ConstantInt>(SI->getTrueValue()) &&
+      isa<ConstantInt>(SI->getFalseValue())) {
+    // Pick between the hoisted keys of both arms, this stands for a single
+    // decode in the unhoisted output
+    Value *TKey = get(IRB, SI->getTrueValue());
+    Value *FKey = get(IRB, SI->getFalseValue());
+    LoadsRequested -= (GXorKey ? 1 : 0) + (XorKeys ? 1 : 0);
+    return IRB.CreateSelect(SI->getCondition(), TKey, FKey);
+  }
+  if (!Hoist || (!CIdx && !IndexFree)) {
+    return build(IRB, Idx, GXorKey ? loadXorKey(IRB) : nullptr);
+  }
+
+  Value *&Key = HoistedKeys[IndexFree ? nullptr : CIdx];
+  if (!Key) {
+    Value *XorKey = GXorKey ? loadXorKey(IRB) : nullptr;
+    IRBuilder<> EntryIRB = getEntryBuilder();
+    Key = build(EntryIRB, Idx, XorKey);
+    updateLastHoisted(EntryIRB);
+  }
+  return Key;
+}
+
+bool obfuscationRemarksEnabled(const Function &F) {
+  const LLVMContext &Ctx = F.getContext();
+  return Ctx.getLLVMRemarkStreamer() ||
+         Ctx.getDiagHandlerPtr()->isAnyRemarkEnabled();
+}
+
+void seedRandomEngine(CryptoUtils &RandomEngine,
+                      const ObfuscationOptions *Options, StringRef PassName,
+                      const Module &M, const Function *F) {
+  if (Options->seed().empty()) {
+    return;
+  }
+
+  std::string Material;
+  raw_string_ostream OS(Material);
+  OS << Options->seed() << '|' << M.getModuleIdentifier() << '|' << PassName;
+  if (F) {
+    OS << '|' << F->getName();
+  }
+  OS.flush();
+
+  unsigned char Hash[32];
+  RandomEngine.sha256(Material.c_str(), Hash);
+
+  // The first 128 bits of the hash become the AES-CTR key
+  std::string Hex;
+  raw_string_ostream HexOS(Hex);
+  for (unsigned i = 0; i < 16; i++) {
+    HexOS << format_hex_no_prefix(Hash[i], 2);
+  }
+  RandomEngine.prng_seed(HexOS.str());
+}
+
 uint64_t getRandomNumber() {
-  static std::mt19937 engine(std::random_device{}());
-  static std::uniform_int_distribution<uint64_t> dist(0, 0xffffffffffffffff);
+  // One engine per thread, parallel backends never share generator state
+  thread_local std::mt19937_64 engine(std::random_device{}());
+  thread_local std::uniform_int_distribution<uint64_t> dist(
+      0, 0xffffffffffffffff);
   return dist(engine);
 }
 